@@ -0,0 +1,2 @@
+@CL /O2 /LD /DLUNAR_ENV_LIB /Iinclude main.cpp /link opengl32.lib lib\sfml-window.lib lib\sfml-system.lib lib\sfml-network.lib lib\sfml-graphics.lib lib\sfml-audio.lib lib\openal32.lib lib\flac.lib lib\freetype.lib lib\ogg.lib lib\vorbis.lib lib\vorbisfile.lib lib\vorbisenc.lib /out:build/LunarOasisEnv.dll
+@del main.obj
@@ -0,0 +1,56 @@
+#ifndef LUNAR_ENV_H
+#define LUNAR_ENV_H
+
+/* Headless batch environments for driving Lunar Oasis from agents.
+ *
+ * Build main.cpp with LUNAR_ENV_LIB defined (see build-env.bat) to get a library
+ * without the game's main(). Each env is a full level simulation; lunarEnvStep
+ * advances all of them by one 1/60s tick, spread over worker threads. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+#define LUNAR_ENV_EXTERN extern "C"
+#else
+#define LUNAR_ENV_EXTERN
+#endif
+#ifdef _WIN32
+#define LUNAR_ENV_API LUNAR_ENV_EXTERN __declspec(dllexport)
+#else
+#define LUNAR_ENV_API LUNAR_ENV_EXTERN
+#endif
+
+/* one byte of these per env and step */
+#define LUNAR_ACT_THRUST 1
+#define LUNAR_ACT_LEFT   2
+#define LUNAR_ACT_RIGHT  4
+#define LUNAR_ACT_BOMB   8
+
+/* frames are the raw 64x64 RGBA game view, env i at frames + i * LUNAR_FRAME_BYTES */
+#define LUNAR_FRAME_BYTES (64*64*4)
+
+typedef struct lunarObsType {
+    float x, y, vx, vy;
+    float angle;   /* 0..8, one unit per ship sprite */
+    float fuel;    /* 0..1 */
+    float water;   /* waterLogged, 0..1 */
+    int32_t bombs;
+    uint8_t landed, dead, won, done;
+} lunarObsType;
+
+typedef struct lunarEnvsType lunarEnvsType;
+
+/* load shared assets once per process, returns 0 on failure */
+LUNAR_ENV_API int lunarEnvInit(const char * spriteSheet);
+
+/* k envs, env i plays levels[i] (1..6); threads <= 0 picks the hardware concurrency */
+LUNAR_ENV_API lunarEnvsType * lunarEnvCreate(int k, const int * levels, int threads);
+LUNAR_ENV_API void lunarEnvDestroy(lunarEnvsType * envs);
+
+/* restart env i on its level; done envs are also restarted automatically on the next step */
+LUNAR_ENV_API void lunarEnvReset(lunarEnvsType * envs, int i);
+
+/* actions: k bytes. frames: k * LUNAR_FRAME_BYTES or NULL. obs: k entries or NULL */
+LUNAR_ENV_API void lunarEnvStep(lunarEnvsType * envs, const uint8_t * actions, uint8_t * frames, lunarObsType * obs);
+
+#endif
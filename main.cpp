@@ -3,10 +3,32 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <queue>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
 #include <SFML/Audio.hpp>
+#include <SFML/Network.hpp>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "lunar-env.h"
 
 #define MAX(_X, _Y) ((_X) > (_Y) ? (_X) : (_Y))
 #define MIN(_X, _Y) ((_X) < (_Y) ? (_X) : (_Y))
@@ -40,58 +62,392 @@ struct prtType {
     float life;
     float shadef;
     prtType * next;
+    int cell; // phash slot this particle was linked into, -1 if none
+    float restX, restY; // where water last came to rest
+    int still;          // frames spent within PRT_SLEEP_BOX of rest, asleep from PRT_SLEEP_FRAMES on
+    int lag, step;      // frames this particle is behind, frames it's advanced by this tick
+    uint16_t rock;      // debris: the terrainBfr height it was carved from, 0 for fire & water
+    uint32_t clr;       // debris: colour of the lit rock it came from
 };
-prtType ** phash;
-prtType * plist;
 const int MAX_PRT = 5000;
+// spouts, particles & pooled water step at this rate, a --sim-hz 30 tick runs them twice
+const int BASE_HZ = 60;
+static inline int baseTicks(double dt) {
+    return MAX((int)lround(dt * BASE_HZ), 1);
+}
+// pooled water that hasn't left a small box for half a second stops being simulated until
+// an explosion, the ship or a hard knock from a neighbour wakes it
+const int PRT_SLEEP_FRAMES = 30;
+const float PRT_SLEEP_BOX = 0.5f;
+const float PRT_WAKE_SPEED = 4.f;
+// particles further than PRT_LOD_NEAR/PRT_LOD_FAR px from the camera (the view is 32 each way)
+// are advanced every 2nd/4th tick by that many ticks at once, unless that would move them
+// more than PRT_LOD_MAX_MOVE px in one go
+const int PRT_LOD_NEAR = 48;
+const int PRT_LOD_FAR = 128;
+const float PRT_LOD_MAX_MOVE = 0.5f;
+// particle budgets, stepped down by the governor in the main loop when frames run long. Headless
+// games keep level 0 so hashes & env steps don't depend on the machine.
+struct qualityType {
+    int level;
+    float spawn;         // of the fire an explosion throws out
+    int spout;           // water particles per spout per tick
+    int forceCap;        // neighbours that push a particle per tick, 0 for no limit
+    int lodNear, lodFar; // in place of PRT_LOD_NEAR/PRT_LOD_FAR
+};
+const qualityType QUALITY_LEVELS[] = {
+    { 0, 1.f,   8, 0,  PRT_LOD_NEAR, PRT_LOD_FAR },
+    { 1, 0.75f, 6, 16, 40,           96 },
+    { 2, 0.5f,  4, 8,  36,           64 },
+    { 3, 0.25f, 2, 4,  32,           48 }
+};
+const int N_QUALITY = 4;
+// water that settles is handed over to a per px volume on the particle grid which flows as a
+// cellular automaton, pooled px only cost anything while they're still moving. Bombs & the ship
+// turn it back into particles.
+const int WATER_UNIT_FRAMES = 64;                     // pooled px count down their life in units of this many ticks
+const int WATER_SWEEP_ROWS = 512 / WATER_UNIT_FRAMES; // rows aged each tick
+const int WATER_FLOW = 8;                             // px a pooled px looks sideways for somewhere lower to go
+const int WATER_STACK = 32;                           // px a settling particle looks up for room in a pool
+enum { WATER_QUEUED = 1, WATER_MOVED = 2 };
+// rock an explosion carves out flies off as debris and is baked back into terrainBfr where
+// it lands slowly enough on something flat enough, so heaps build up a px at a time
+const float DEBRIS_PUSH = 20.f;  // px/s, outwards from the blast
+const float DEBRIS_LIFE = 15.f;  // s, lost if it hasn't settled by then
+const float DEBRIS_MASS = 0.3f;
+const float DEBRIS_SETTLE = 3.f; // px/s
+const float DEBRIS_FLOOR = 0.5f; // -normal.y of the steepest rock it settles on
+
+// rock as a signed distance field on SDF_CELL px cells of the particle grid, with the normal
+// stored alongside so a particle gets both from one lookup
+const int SDF_CELL = 2;
+const int SDF_RES = 512 / SDF_CELL;
+const float SDF_MAX = 16.f;  // px, distances are clamped to this
+const float SDF_SCALE = 4.f; // stored units per px
+struct sdfType {
+    int8_t d, nx, ny, pad; // distance * SDF_SCALE from the cell's first px centre, negative in rock; outward normal * 127
+};
+// the ship's hull (its SHIP_OFF mask) trades momentum with the water particles it overlaps
+const float SHIP_WATER_MASS = 40.f;  // in the units of prtType::mass, a water particle is 0.1
+const float SHIP_WATER_COUPLE = 4.f; // 1/s, how fast water in the hull takes on the ship's velocity
+const float SHIP_WATER_PUSH = 8.f;   // px/s^2 shoving water out of the hull
+const float SHIP_SPLASH = 4.f;       // 1/s, extra shove per px/s the ship is moving at
+const float SHIP_BUOYANCY = 0.75f;   // of GRAVITY, fully under water
+const float SHIP_WATER_DRAG = 2.f;   // 1/s, fully under water
 
 RenderWindow * window = NULL;
 Texture * tex64 = NULL;
 Sprite * spr64 = NULL;
-uint8_t * bfr64 = NULL;
-Texture * spritesTex = NULL;
+thread_local uint8_t * bfr64 = NULL; // render target, per thread so headless envs can draw in parallel
+
+// hot path call counts, read and reset once a frame by the telemetry
+struct tmCountType {
+    int collideCalls, terrainWrites, soundsStarted;
+};
+thread_local tmCountType tmCount;
+Image * spritesImg = NULL;
 const uint32_t * sprBfr;
-uint16_t * terrainBfr = NULL;
-uint8_t * tspecBfr = NULL;
 
-float playerX, playerY, playerVX, playerVY, playerAngle, playerFuel, waterLogged;
-bool playerDead, beatLevel;
-int playerBombs;
-float flagX, flagY, flagH, flagVis;
+/* ENTITIES */
+// Depots, bomb pickups, bombs and spouts are each packed into a vector, a removed one has the
+// last moved into its place. Depots & pickups are also bucketed on an ENT_CELL px grid for the
+// "anything within r px of here" tests, which visit them in the order they were placed.
 
 struct depotType {
-    bool exists;
+    int id; // placement order
     float x, y, fuel;
 };
 
 struct bombType {
-    bool exists;
     float t;
     float x, y, xv, yv;
+    float ox, oy; // at the start of the tick
 };
 
 struct bombPickupType {
-    bool exists;
+    int id; // placement order
     bool available;
     float x, y;
 };
 
 struct waterSpoutType {
-    bool exists;
     float x, y;
 };
 
-const int MAX_SPOUT = 8;
-waterSpoutType spouts[MAX_SPOUT];
+const int ENT_CELL = 16;
+const int ENT_GRID = 512 / ENT_CELL;
+enum { ENT_DEPOT, ENT_PICKUP };
+
+// removes the entries at the pool indices in idx
+template<class T> static void entRemove(vector<T> & pool, vector<int> & idx) {
+    std::sort(idx.begin(), idx.end());
+    for (int k=(int)idx.size()-1; k>=0; k--) {
+        pool[idx[k]] = pool.back();
+        pool.pop_back();
+    }
+}
+/* --- */
+
+// rock a crater cut loose, falls straight down and is stamped back in where it lands
+struct chunkType {
+    bool exists;
+    int x, w, h;           // left px & size of its box
+    float y, yv;           // top of its box
+    vector<uint16_t> rock; // w x h terrainBfr heights, 0 where it's empty
+    vector<uint32_t> clr;  // colour of each px as it was lit when it broke off
+};
+
+const int MAX_CHUNKS = 8;        // pieces cut loose while all of these are falling crumble instead
+const int ISLAND_REACH = 48;     // px around a crater searched for rock it cut loose
+const int ISLAND_MIN_PX = 16;    // anything smaller crumbles into debris
+const int ISLAND_MAX_PX = 4096;  // anything bigger stays put
+
+/* RNG */
+// xoshiro128** - small, fast and identical on every platform, unlike rand()
+struct rngType {
+    uint32_t s[4];
+};
+
+static inline uint32_t rngRotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t rngInt(rngType & r) {
+    const uint32_t ret = rngRotl(r.s[1] * 5u, 7) * 9u;
+    const uint32_t t = r.s[1] << 9u;
+    r.s[2] ^= r.s[0];
+    r.s[3] ^= r.s[1];
+    r.s[1] ^= r.s[2];
+    r.s[0] ^= r.s[3];
+    r.s[2] ^= t;
+    r.s[3] = rngRotl(r.s[3], 11);
+    return ret;
+}
+
+void rngSeed(rngType & r, uint64_t seed) {
+    for (int i=0; i<4; i++) { // splitmix64
+        seed += 0x9E3779B97F4A7C15ull;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30u)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27u)) * 0x94D049BB133111EBull;
+        r.s[i] = (uint32_t)((z ^ (z >> 31u)) >> 16u);
+    }
+}
+
+/* --- */
+
+/* JOBS */
+// One pool of worker threads for splitting a loop over rows, columns or landers. The range is
+// cut into chunks of grain by the range alone, never by how many threads there are, and each
+// chunk only writes its own part, so results are the same with --jobs 1 or 16. Threads take
+// the next chunk off a shared counter and the caller works alongside them; between loops the
+// workers sleep on a condition variable. Loops started inside a chunk, on another thread while
+// one is running (level preload, env workers) or with no pool just run inline.
+
+typedef void (*jobFnType)(void * ctx, int i1, int i2);
+
+struct jobPoolType {
+    vector<std::thread> workers;
+    std::mutex busy;            // held by the thread whose loop the pool is on
+    std::mutex m;
+    std::condition_variable wake, done;
+    uint64_t gen;               // bumped for each loop
+    int running;                // workers not yet done with this loop
+    bool quit;
+    jobFnType fn;
+    void * ctx;
+    int n, grain;
+    std::atomic<int> next;      // next chunk to take
+};
+
+jobPoolType jobPool;
+static thread_local bool inJob = false;
+
+static void jobChunks(jobPoolType & p) {
+    const int chunks = (p.n + p.grain - 1) / p.grain;
+    inJob = true;
+    for (int c = p.next++; c < chunks; c = p.next++) {
+        p.fn(p.ctx, c * p.grain, MIN((c + 1) * p.grain, p.n));
+    }
+    inJob = false;
+}
+
+static void jobWorker() {
+    jobPoolType & p = jobPool;
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(p.m);
+            p.wake.wait(lk, [&]{ return p.quit || p.gen != seen; });
+            if (p.quit) {
+                return;
+            }
+            seen = p.gen;
+        }
+        jobChunks(p);
+        std::lock_guard<std::mutex> lk(p.m);
+        if (--p.running == 0) {
+            p.done.notify_one();
+        }
+    }
+}
+
+void jobsStop() {
+    {
+        std::lock_guard<std::mutex> lk(jobPool.m);
+        jobPool.quit = true;
+    }
+    jobPool.wake.notify_all();
+    for (int i=0; i<(int)jobPool.workers.size(); i++) {
+        jobPool.workers[i].join();
+    }
+    jobPool.workers.clear();
+}
+
+// threads counts the caller, 0 for one per hardware thread, 1 runs everything inline
+void jobsStart(int threads) {
+    if (threads <= 0) {
+        threads = MAX(1, (int)std::thread::hardware_concurrency());
+    }
+    jobPool.gen = 0;
+    jobPool.running = 0;
+    jobPool.quit = false;
+    for (int i=1; i<threads; i++) {
+        jobPool.workers.push_back(std::thread(jobWorker));
+    }
+    if (threads > 1) {
+        atexit(jobsStop);
+    }
+}
+
+void parallelForRaw(int n, int grain, jobFnType fn, void * ctx) {
+    grain = MAX(grain, 1);
+    if (n <= grain || inJob || jobPool.workers.empty() || !jobPool.busy.try_lock()) {
+        for (int i=0; i<n; i+=grain) {
+            fn(ctx, i, MIN(i + grain, n));
+        }
+        return;
+    }
+    jobPoolType & p = jobPool;
+    {
+        std::lock_guard<std::mutex> lk(p.m);
+        p.fn = fn;
+        p.ctx = ctx;
+        p.n = n;
+        p.grain = grain;
+        p.next = 0;
+        p.running = (int)p.workers.size();
+        p.gen += 1;
+    }
+    p.wake.notify_all();
+    jobChunks(p);
+    {
+        std::unique_lock<std::mutex> lk(p.m);
+        p.done.wait(lk, [&]{ return p.running == 0; });
+    }
+    p.busy.unlock();
+}
+
+// f(i1, i2) for each chunk [i1, i2) of 0..n
+template<class F> void parallelFor(int n, int grain, const F & f) {
+    parallelForRaw(n, grain, [](void * ctx, int i1, int i2) { (*(const F *)ctx)(i1, i2); }, (void *)&f);
+}
 
-const int MAX_DEPOT = 16;
-depotType depots[MAX_DEPOT];
+/* --- */
 
-const int MAX_BOMB_PICKUP = 8;
-bombPickupType bombPickups[MAX_BOMB_PICKUP];
+struct inputType {
+    bool up, left, right, bomb;
+};
 
-const int MAX_BOMBS = 8;
-bombType bombs[MAX_BOMBS];
+// Everything that makes up one running level. The game owns a single one; headless
+// environments (lunar-env.h) own as many as they like and step them on worker threads.
+struct gameType {
+    uint16_t * terrainBfr;
+    uint8_t * tspecBfr;
+    prtType ** phash;
+    prtType * plist;
+    int prtTop; // plist slots at and above this are all dead
+    uint8_t * waterBfr;  // pooled water on the 512x512 particle grid, units of life left, 0 if dry
+    uint8_t * waterMark; // WATER_QUEUED/WATER_MOVED per px
+    vector<int> waterActive, waterNext; // pooled px that may still flow this and next tick
+    int waterCells, waterTick;
+    sdfType * sdf; // SDF_RES x SDF_RES
+    uint8_t * shadeBfr;  // 512x512 PAL_INDEX of each solid px as terrainShade lights it, 0 where clear
+    uint32_t terrainGen; // bumped by rockChanged
+    qualityType quality;
+
+    float playerX, playerY, playerVX, playerVY, playerAngle, playerFuel, waterLogged;
+    bool playerDead, beatLevel;
+    int playerBombs;
+    float flagX, flagY, flagH, flagVis;
+
+    vector<waterSpoutType> spouts;
+    vector<depotType> depots;
+    vector<bombPickupType> bombPickups;
+    vector<bombType> bombs;
+    vector<int> entStart, entList; // per grid cell, its run of (pool index << 1) | ENT_* in entList
+    bool entDirty;                 // depots or pickups added or removed since the grid was built
+    chunkType chunks[MAX_CHUNKS];
+
+    int curLevel;
+    double time;
+    float flashT, lastEngineT;
+    bool wasLanded, wasGearDown, restarting;
+    bool silent; // no sound, for headless stepping
+
+    rngType rngLevel, // terrain & object placement in initLevel
+            rngPrt,   // particle emitters
+            rngFx;    // camera shake & other cosmetic effects
+
+    void alloc();
+    void release();
+    void copyFrom(const gameType & o);
+
+    void playSound(int _sfx, double rate=1., double vol=1.);
+
+    bool sprCollideTerrain(int _sx, int _sy, int _w, int _h, int dx, int dy);
+    bool sprCollideTerrain(uint64_t code, int x, int y);
+    bool sprSweepTerrain(uint64_t code, float x0, float y0, float x1, float y1, int ox, int oy, float & toi, float & nx, float & ny);
+    void terrainClear();
+    void terrainAdd(uint64_t spr, int cx, int cy, int z, int scale = 100);
+    uint8_t terrainShadeIndex(int x, int y, int t00) const;
+    uint32_t terrainShade(int x, int y, int t00) const;
+    void shadeUpdate(int x1, int y1, int x2, int y2);
+    void rockChanged(int x1, int y1, int x2, int y2);
+    void terrainRender(int cx, int cy);
+    prtType debrisParticle(int x, int y, float xv, float yv) const;
+    void islandCheck(int x1, int y1, int x2, int y2);
+    int chunkHits(const chunkType & c, int y);
+    void updateRenderChunks(float dt, int cx, int cy);
+    void sdfUpdate(int x1, int y1, int x2, int y2);
+    float sdfAt(float x, float y, float & nx, float & ny) const;
+    bool sdfCollide(float ox, float oy, float & x, float & y, float & nx, float & ny) const;
+
+    void clearParticles();
+    int addParticles(const prtType * ps, int n, bool force = false);
+    bool addParticle(const prtType & p, bool force = false);
+    prtType fireParticle(float x, float y, float xv, float yv, float lifef);
+    void addFire(float x, float y, float xv, float yv, int cnt = 4, float lifef = 1.0f);
+    void addWater(float x, float y, float xv, float yv, int cnt = 8, float lifef = 5.0f);
+    void explosion(float x, float y, float xv, float yv, int cnt);
+    void prtHashBuild();
+    void updateRenderParticles(float dt, int cx, int cy, bool draw);
+    void wakeParticles(int x1, int y1, int x2, int y2);
+    bool waterFree(int x, int y);
+    void waterQueue(int x, int y);
+    bool waterPool(const prtType & p);
+    void updateRenderWater(int cx, int cy, bool draw);
+    float waterCountInRadius(float x, float y, float r);
+    float waterPercentInRadius(float x, float y, float r);
+    void shipWater(float dt);
+
+    void entIndex();
+    void entNear(int kind, float x, float y, float r, vector<int> & out);
+    void blastObjects(float x, float y, float pickupR, float pickupFlash);
+
+    void initLevel(int _levelNo);
+    void update(double dt, const inputType & in);
+};
 
 /* SPRITES */
 const uint64_t ROCKS[] = {
@@ -202,6 +558,9 @@ uint32_t PAL_RED[9],
          PAL_BLUE[9],
          PAL_BROWN[9],
          PAL_GREY[9];
+// all of the above as one table, PAL_INDEX[1 + row * 9 + i] is entry i of row (in PAL_SPR order), 0 is clear
+uint32_t PAL_INDEX[1 + 6 * 9];
+const int PAL_ROW_GREEN = 1, PAL_ROW_GREY = 5;
 
 const uint64_t LEVEL_BG_1 = BG_SPR[0];
 const int LEVEL_START_X_1 = 4, LEVEL_START_Y_1 = 2;
@@ -654,12 +1013,10 @@ const int LEVEL_START_Y[] {
 };
 const int N_LEVELS = 6;
 
-int curLevel = 1, levelsBeat = 0;
+int levelSel = 1, levelsBeat = 0; // level select cursor, the level being played is game->curLevel
+gameType * game = NULL;
 
 /* SFX */
-const int MAX_SOUNDS = 64;
-int soundIdx = 0;
-Sound sounds[MAX_SOUNDS];
 SoundBuffer sfx[63];
 const int SFX_BOMB = 0;
 const int SFX_DIE = 1;
@@ -674,24 +1031,535 @@ const int SFX_LAND = 9;
 const int SFX_FUEL_WARNING = 10;
 const int SFX_FLAG = 11;
 const int SFX_WATER = 12;
-const int SFX_MUSIC_1 = 13;
+const int N_SFX = 13;
+
+const char * SFX_FILES[N_SFX] = {
+    "sfx/bomb-explode.wav",
+    "sfx/ship-explode.wav",
+    "sfx/get-fuel.wav",
+    "sfx/hover.wav",
+    "sfx/select.wav",
+    "sfx/get-bomb.wav",
+    "sfx/engine.wav",
+    "sfx/back.wav",
+    "sfx/use-bomb.wav",
+    "sfx/land.wav",
+    "sfx/fuel-warning.wav",
+    "sfx/flag.wav",
+    "sfx/water-loop.wav"
+};
 
-void loadSound(int _sfx, const char * fileName) {
+// sfx[i] belongs to the loader threads until sfxReady[i] is set, a missing sound stays silent
+std::atomic<bool> sfxReady[N_SFX];
+
+bool loadSound(int _sfx, const char * fileName) {
     if (!sfx[_sfx].loadFromFile(fileName)) {
         cerr << "Error loading: " << fileName << endl;
-        exit(0);
+        return false;
+    }
+    sfxReady[_sfx] = true;
+    return true;
+}
+
+/* --- */
+
+/* MIXER */
+// Every sound but the music goes through one SoundStream. playSound() only queues a trigger,
+// mixerFrame() merges the frame's identical ones (same sound & pitch, loudest wins) and hands
+// them to the audio thread. That keeps the MIX_VOICES best ranked one-shots, priority times
+// volume, and a new sound only takes the voice of one that ranks lower. The engine, fuel
+// warning & water loops have a channel each.
+
+const int MIX_RATE = 44100;
+const int MIX_FRAMES = 1024; // stereo frames per chunk, ~23 ms
+const int MIX_VOICES = 16;
+enum { MIX_LOOP_ENGINE, MIX_LOOP_WARNING, MIX_LOOP_WATER, N_MIX_LOOPS };
+const int MIX_LOOP_SFX[N_MIX_LOOPS] = { SFX_ENGINE, SFX_FUEL_WARNING, SFX_WATER };
+const int SFX_PRIORITY[N_SFX] = {
+    6,  // SFX_BOMB
+    9,  // SFX_DIE
+    5,  // SFX_FUEL
+    3,  // SFX_HOVER
+    8,  // SFX_SELECT
+    7,  // SFX_GET_BOMB
+    1,  // SFX_ENGINE
+    8,  // SFX_BACK
+    5,  // SFX_USE_BOMB
+    4,  // SFX_LAND
+    1,  // SFX_FUEL_WARNING
+    10, // SFX_FLAG
+    1   // SFX_WATER
+};
+
+struct mixVoiceType {
+    int sfx;            // -1 when free
+    uint64_t pos, step; // source frames, 32.32 fixed point
+    int vol;            // 0..256
+    int rank;
+};
+
+struct mixTriggerType {
+    int sfx;
+    float rate, vol;
+};
+
+struct mixerType : public SoundStream {
+    std::mutex lock;
+    mixVoiceType voices[MIX_VOICES];
+    mixVoiceType loops[N_MIX_LOOPS];
+    vector<mixTriggerType> incoming; // from mixerFrame, started on the next chunk
+    int32_t acc[MIX_FRAMES * 2];
+    int16_t out[MIX_FRAMES * 2];
+
+    mixerType();
+    ~mixerType();
+    void start(const mixTriggerType & t);
+    bool onGetData(Chunk & data);
+    void onSeek(Time offset) {}
+};
+
+mixerType * mixer = NULL;
+vector<mixTriggerType> mixPending; // this frame's triggers, main thread only
+
+static uint64_t mixStep(int _sfx, float rate) {
+    return (uint64_t)((double)rate * sfx[_sfx].getSampleRate() / MIX_RATE * 4294967296.);
+}
+
+mixerType::mixerType() {
+    for (int i=0; i<MIX_VOICES; i++) {
+        voices[i].sfx = -1;
+    }
+    for (int i=0; i<N_MIX_LOOPS; i++) {
+        loops[i].sfx = MIX_LOOP_SFX[i];
+        loops[i].pos = 0;
+        loops[i].step = 0;
+        loops[i].vol = 0;
+    }
+    initialize(2, MIX_RATE);
+}
+
+mixerType::~mixerType() {
+    stop(); // the stream thread calls onGetData, it has to end before this does
+}
+
+void mixerType::start(const mixTriggerType & t) {
+    mixVoiceType v;
+    v.sfx = t.sfx;
+    v.pos = 0;
+    v.step = mixStep(t.sfx, t.rate);
+    v.vol = CLAMP((int)(t.vol * 256.f), 0, 256);
+    v.rank = SFX_PRIORITY[t.sfx] * v.vol;
+    int slot = -1;
+    for (int i=0; i<MIX_VOICES; i++) {
+        if (voices[i].sfx < 0) {
+            slot = i;
+            break;
+        }
+        if (voices[i].rank < v.rank && (slot < 0 || voices[i].rank < voices[slot].rank)) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        voices[slot] = v;
+    }
+}
+
+// adds MIX_FRAMES of v to acc. At unit pitch the source is read straight through so the
+// compiler can vectorise it, anything else steps through it in fixed point
+static bool mixVoice(int32_t * acc, mixVoiceType & v, bool loop) {
+    const SoundBuffer & b = sfx[v.sfx];
+    const Int16 * src = b.getSamples();
+    const int ch = (int)b.getChannelCount();
+    const uint64_t frames = b.getSampleCount() / MAX(ch, 1);
+    if (frames == 0 || v.step == 0) {
+        return loop;
+    }
+    const int vol = v.vol, r = ch - 1;
+    for (int i=0; i<MIX_FRAMES; ) {
+        uint64_t at = v.pos >> 32;
+        if (at >= frames) {
+            if (!loop) {
+                return false;
+            }
+            v.pos -= frames << 32;
+            continue;
+        }
+        if (v.step == (1ull << 32)) {
+            int n = (int)MIN((uint64_t)(MIX_FRAMES - i), frames - at);
+            const Int16 * s = src + at * ch;
+            int32_t * a = acc + i * 2;
+            for (int k=0; k<n; k++) {
+                a[k*2] += (s[k*ch] * vol) >> 8;
+                a[k*2+1] += (s[k*ch+r] * vol) >> 8;
+            }
+            v.pos += (uint64_t)n << 32;
+            i += n;
+        }
+        else {
+            const Int16 * s = src + at * ch;
+            acc[i*2] += (s[0] * vol) >> 8;
+            acc[i*2+1] += (s[r] * vol) >> 8;
+            v.pos += v.step;
+            i += 1;
+        }
     }
+    return true;
 }
 
-void playSound(SoundBuffer & bfr, double rate=1., double vol=1.) {
-    sounds[soundIdx].setBuffer(bfr);
-    sounds[soundIdx].setVolume(vol*100.);
-    sounds[soundIdx].setPitch(rate);
-    sounds[soundIdx].play();
-    soundIdx = (soundIdx + 1) % MAX_SOUNDS;
+bool mixerType::onGetData(Chunk & data) {
+    memset(acc, 0, sizeof(acc));
+    {
+        std::lock_guard<std::mutex> l(lock);
+        for (int i=0; i<(int)incoming.size(); i++) {
+            start(incoming[i]);
+        }
+        incoming.clear();
+        for (int i=0; i<MIX_VOICES; i++) {
+            if (voices[i].sfx >= 0 && !mixVoice(acc, voices[i], false)) {
+                voices[i].sfx = -1;
+            }
+        }
+        for (int i=0; i<N_MIX_LOOPS; i++) {
+            if (loops[i].vol > 0 && sfxReady[loops[i].sfx]) {
+                mixVoice(acc, loops[i], true);
+            }
+        }
+    }
+    for (int i=0; i<MIX_FRAMES * 2; i++) {
+        out[i] = (int16_t)CLAMP(acc[i], -32768, 32767);
+    }
+    data.samples = out;
+    data.sampleCount = MIX_FRAMES * 2;
+    return true;
 }
+
 void playSound(int _sfx, double rate=1., double vol=1.) {
-    playSound(sfx[_sfx], rate, vol);
+    if (mixer && sfxReady[_sfx]) {
+        mixTriggerType t = { _sfx, (float)rate, (float)vol };
+        mixPending.push_back(t);
+    }
+}
+
+// vol 0..1, like playSound
+void mixerLoop(int loop, float vol, float pitch) {
+    if (mixer) {
+        std::lock_guard<std::mutex> l(mixer->lock);
+        mixVoiceType & v = mixer->loops[loop];
+        v.vol = CLAMP((int)(vol * 256.f), 0, 256);
+        v.step = sfxReady[v.sfx] ? mixStep(v.sfx, pitch) : 0;
+    }
+}
+
+// once a frame, after everything that might play a sound
+void mixerFrame() {
+    if (!mixer || mixPending.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(mixer->lock);
+    for (int i=0; i<(int)mixPending.size(); i++) {
+        const mixTriggerType & t = mixPending[i];
+        bool dupe = false;
+        for (int j=0; j<(int)mixer->incoming.size() && !dupe; j++) {
+            mixTriggerType & o = mixer->incoming[j];
+            if (o.sfx == t.sfx && fabs(o.rate - t.rate) < 0.001f) {
+                o.vol = MAX(o.vol, t.vol);
+                dupe = true;
+            }
+        }
+        if (!dupe) {
+            mixer->incoming.push_back(t);
+            tmCount.soundsStarted += 1;
+        }
+    }
+    mixPending.clear();
+}
+/* --- */
+
+void palIndexBuild() {
+    const uint32_t * rows[6] = { PAL_RED, PAL_GREEN, PAL_PINK, PAL_BLUE, PAL_BROWN, PAL_GREY };
+    PAL_INDEX[0] = 0;
+    for (int r=0; r<6; r++) {
+        for (int i=0; i<9; i++) {
+            PAL_INDEX[1 + r * 9 + i] = rows[r][i];
+        }
+    }
+}
+
+void loadPalettes() {
+    for (int i=0; i<9; i++) {
+        int x1 = SPR_X(PAL_SPR),
+            y1 = SPR_Y(PAL_SPR);
+        PAL_RED[i]   = sprBfr[x1 + i + ((y1+0) << 10)];
+        PAL_GREEN[i] = sprBfr[x1 + i + ((y1+1) << 10)];
+        PAL_PINK[i]  = sprBfr[x1 + i + ((y1+2) << 10)];
+        PAL_BLUE[i]  = sprBfr[x1 + i + ((y1+3) << 10)];
+        PAL_BROWN[i] = sprBfr[x1 + i + ((y1+4) << 10)];
+        PAL_GREY[i]  = sprBfr[x1 + i + ((y1+5) << 10)];
+    }
+    palIndexBuild();
+}
+
+bool loadSprites(const char * fileName) {
+    spritesImg = new Image();
+    if (!spritesImg->loadFromFile(fileName)) {
+        return false;
+    }
+    sprBfr = (const uint32_t*)spritesImg->getPixelsPtr();
+    loadPalettes();
+    return true;
+}
+
+/* ASSET PACK */
+// assets.pak, written by --pack-assets from the PNG & WAVs: the sprite sheet as raw 1024 wide
+// RGBA, the palette rows and 16 bit PCM for every sound. It's mapped read-only at startup and
+// sprBfr points straight into it, so nothing gets decoded. SoundBuffer keeps its own copy of
+// the samples, those are copied once out of the map. Music streams from its own files.
+
+const uint32_t PACK_MAGIC = 0x4B504F4C; // "LOPK"
+const uint32_t PACK_VERSION = 2;
+const char * PACK_FILE = "assets.pak";
+
+struct packSoundType {
+    uint64_t offset, sampleCount;
+    uint32_t channels, sampleRate;
+};
+
+struct packHeadType {
+    uint32_t magic, version;
+    uint32_t atlasW, atlasH;
+    uint64_t atlasOffset;
+    uint32_t pal[6][9];      // PAL_RED .. PAL_GREY
+    packSoundType sounds[N_SFX];
+};
+
+uint32_t * const PACK_PALS[6] = { PAL_RED, PAL_GREEN, PAL_PINK, PAL_BLUE, PAL_BROWN, PAL_GREY };
+
+// whole file, read-only. Stays mapped for the life of the process unless given to unmapFile
+const uint8_t * mapFile(const char * fileName, size_t & size) {
+#ifdef _WIN32
+    HANDLE fh = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fh == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER len;
+    HANDLE mh = GetFileSizeEx(fh, &len) ? CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    CloseHandle(fh);
+    if (!mh) {
+        return NULL;
+    }
+    const uint8_t * data = (const uint8_t *)MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mh);
+    size = (size_t)len.QuadPart;
+    return data;
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void * data = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    size = (size_t)st.st_size;
+    return (const uint8_t *)data;
+#endif
+}
+
+void unmapFile(const uint8_t * data, size_t size) {
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+const uint8_t * packData = NULL;
+packHeadType packHead;
+
+// false if there's no usable pack, the caller falls back on the PNG & WAVs. Sounds are
+// left to loadPackSound
+bool loadPack(const char * fileName) {
+    size_t size = 0;
+    const uint8_t * data = mapFile(fileName, size);
+    if (!data) {
+        return false;
+    }
+    packHeadType head;
+    bool ok = size >= sizeof(head);
+    if (ok) {
+        memcpy(&head, data, sizeof(head));
+        ok = head.magic == PACK_MAGIC && head.version == PACK_VERSION && head.atlasW == 1024 &&
+             head.atlasOffset + (uint64_t)head.atlasW * head.atlasH * 4 <= size;
+        for (int i=0; ok && i<N_SFX; i++) {
+            ok = head.sounds[i].offset + head.sounds[i].sampleCount * 2 <= size;
+        }
+    }
+    if (!ok) {
+        cerr << fileName << " is out of date, rebuild it with --pack-assets" << endl;
+        unmapFile(data, size);
+        return false;
+    }
+    packData = data;
+    packHead = head;
+    sprBfr = (const uint32_t *)(data + head.atlasOffset);
+    for (int i=0; i<6; i++) {
+        memcpy(PACK_PALS[i], head.pal[i], sizeof(head.pal[i]));
+    }
+    palIndexBuild();
+    return true;
+}
+
+bool loadPackSound(int _sfx) {
+    const packSoundType & ps = packHead.sounds[_sfx];
+    if (!sfx[_sfx].loadFromSamples((const Int16 *)(packData + ps.offset), ps.sampleCount, ps.channels, ps.sampleRate)) {
+        cerr << "Error loading: " << SFX_FILES[_sfx] << " from " << PACK_FILE << endl;
+        return false;
+    }
+    sfxReady[_sfx] = true;
+    return true;
+}
+
+static void packAlign(FILE * fh, uint64_t & at) {
+    static const uint8_t zero[64] = { 0 };
+    uint64_t pad = (64 - (at & 63)) & 63;
+    fwrite(zero, 1, (size_t)pad, fh);
+    at += pad;
+}
+
+// --pack-assets: offline, from the files the game would otherwise load
+int packAssets(const char * fileName) {
+    if (!loadSprites("sprites/sprite-sheet.png")) {
+        cerr << "Error loading: sprites/sprite-sheet.png" << endl;
+        return 1;
+    }
+    for (int i=0; i<N_SFX; i++) {
+        if (!loadSound(i, SFX_FILES[i])) {
+            return 1;
+        }
+    }
+    packHeadType head;
+    memset(&head, 0, sizeof(head));
+    head.magic = PACK_MAGIC;
+    head.version = PACK_VERSION;
+    head.atlasW = spritesImg->getSize().x;
+    head.atlasH = spritesImg->getSize().y;
+    if (head.atlasW != 1024) {
+        cerr << "the sprite sheet has to be 1024 px wide" << endl;
+        return 1;
+    }
+    for (int i=0; i<6; i++) {
+        memcpy(head.pal[i], PACK_PALS[i], sizeof(head.pal[i]));
+    }
+    uint64_t at = (sizeof(head) + 63) & ~63ull;
+    head.atlasOffset = at;
+    at += (uint64_t)head.atlasW * head.atlasH * 4;
+    for (int i=0; i<N_SFX; i++) {
+        at = (at + 63) & ~63ull;
+        head.sounds[i].offset = at;
+        head.sounds[i].sampleCount = sfx[i].getSampleCount();
+        head.sounds[i].channels = sfx[i].getChannelCount();
+        head.sounds[i].sampleRate = sfx[i].getSampleRate();
+        at += sfx[i].getSampleCount() * 2;
+    }
+
+    FILE * fh = fopen(fileName, "wb");
+    if (!fh) {
+        cerr << "can't write " << fileName << endl;
+        return 1;
+    }
+    at = sizeof(head);
+    fwrite(&head, sizeof(head), 1, fh);
+    packAlign(fh, at);
+    fwrite(sprBfr, 4, (size_t)head.atlasW * head.atlasH, fh);
+    at += (uint64_t)head.atlasW * head.atlasH * 4;
+    for (int i=0; i<N_SFX; i++) {
+        packAlign(fh, at);
+        fwrite(sfx[i].getSamples(), 2, (size_t)sfx[i].getSampleCount(), fh);
+        at += sfx[i].getSampleCount() * 2;
+    }
+    fclose(fh);
+    cout << fileName << ": " << at << " bytes" << endl;
+    return 0;
+}
+/* --- */
+
+/* ASSET LOADING */
+// Sounds decode on a few worker threads while the main thread gets the sprite sheet up and
+// starts drawing the intro.
+vector<std::thread> sfxLoaders;
+std::atomic<int> sfxNext(0), sfxLoadersDone(0);
+
+void sfxLoader() {
+    for (int i=sfxNext++; i<N_SFX; i=sfxNext++) {
+        if (packData) {
+            loadPackSound(i);
+        }
+        else {
+            loadSound(i, SFX_FILES[i]);
+        }
+    }
+    sfxLoadersDone += 1;
+}
+
+void startSfxLoaders() {
+    int n = CLAMP((int)std::thread::hardware_concurrency() - 1, 1, 4);
+    for (int i=0; i<n; i++) {
+        sfxLoaders.push_back(std::thread(sfxLoader));
+    }
+}
+
+void joinSfxLoaders() {
+    for (int i=0; i<(int)sfxLoaders.size(); i++) {
+        sfxLoaders[i].join();
+    }
+    sfxLoaders.clear();
+}
+/* --- */
+
+/* MUSIC */
+// Streamed from disk a chunk at a time by Music's own thread, so memory use doesn't grow with
+// the track, and looped without a gap. Any format SFML reads: WAV, OGG or FLAC. Level n plays
+// sfx/music-n.ogg / .flac / .wav if there is one, everything else sfx/music.wav.
+const char * MUSIC_EXTS[] = { "ogg", "flac", "wav" };
+char musicTracks[N_LEVELS+1][64]; // [0] is the menus
+Music * music = NULL;
+int musicTrack = -1;
+
+void findMusicTracks() {
+    for (int i=0; i<=N_LEVELS; i++) {
+        strcpy(musicTracks[i], "sfx/music.wav");
+        for (int e=0; i>0 && e<3; e++) {
+            char fileName[64];
+            snprintf(fileName, sizeof(fileName), "sfx/music-%d.%s", i, MUSIC_EXTS[e]);
+            FILE * fh = fopen(fileName, "rb");
+            if (fh) {
+                fclose(fh);
+                strcpy(musicTracks[i], fileName);
+                break;
+            }
+        }
+    }
+}
+
+// only restarts the stream when the track actually changes
+void playMusic(int level) {
+    if (musicTrack >= 0 && !strcmp(musicTracks[level], musicTracks[musicTrack])) {
+        return;
+    }
+    musicTrack = level;
+    if (!music) {
+        music = new Music();
+        music->setVolume(75.f);
+        music->setLoop(true);
+    }
+    music->stop();
+    if (!music->openFromFile(musicTracks[level])) {
+        cerr << "Error loading: " << musicTracks[level] << endl;
+        return;
+    }
+    music->play();
 }
 /* --- */
 
@@ -799,7 +1667,85 @@ void drawSpr(uint64_t code, int x, int y) {
     drawSpr(SPR_X(code), SPR_Y(code), SPR_W(code), SPR_H(code), x, y);
 }
 
-bool sprCollideTerrain(int _sx, int _sy, int _w, int _h, int dx, int dy) {
+void gameType::alloc() {
+    terrainBfr = new uint16_t[1024*1024];
+    tspecBfr = new uint8_t[1024*1024];
+    plist = new prtType[MAX_PRT];
+    phash = new prtType*[512*512];
+    waterBfr = new uint8_t[512*512];
+    waterMark = new uint8_t[512*512];
+    sdf = new sdfType[SDF_RES*SDF_RES];
+    memset(sdf, 0x7F, sizeof(sdfType) * SDF_RES * SDF_RES);
+    shadeBfr = new uint8_t[512*512];
+    memset(shadeBfr, 0, 512 * 512);
+    terrainGen = 0;
+    quality = QUALITY_LEVELS[0];
+    curLevel = 1;
+    time = 0.;
+    flashT = 0.f;
+    lastEngineT = 0.f;
+    wasLanded = false;
+    wasGearDown = false;
+    restarting = false;
+    silent = false;
+    clearParticles();
+}
+
+void gameType::release() {
+    delete[] terrainBfr;
+    delete[] tspecBfr;
+    delete[] plist;
+    delete[] phash;
+    delete[] waterBfr;
+    delete[] waterMark;
+    delete[] sdf;
+    delete[] shadeBfr;
+}
+
+// deep copy of another game's state into this one's buffers
+void gameType::copyFrom(const gameType & o) {
+    uint16_t * _terrainBfr = terrainBfr;
+    uint8_t * _tspecBfr = tspecBfr;
+    prtType ** _phash = phash;
+    prtType * _plist = plist;
+    uint8_t * _waterBfr = waterBfr, * _waterMark = waterMark;
+    sdfType * _sdf = sdf;
+    uint8_t * _shadeBfr = shadeBfr;
+    for (int i=0; i<prtTop; i++) {
+        if (plist[i].cell >= 0) {
+            phash[plist[i].cell] = NULL;
+        }
+    }
+    *this = o;
+    terrainBfr = _terrainBfr;
+    tspecBfr = _tspecBfr;
+    phash = _phash;
+    plist = _plist;
+    waterBfr = _waterBfr;
+    waterMark = _waterMark;
+    sdf = _sdf;
+    shadeBfr = _shadeBfr;
+    memcpy(terrainBfr, o.terrainBfr, sizeof(uint16_t) << 20);
+    memcpy(sdf, o.sdf, sizeof(sdfType) * SDF_RES * SDF_RES);
+    memcpy(shadeBfr, o.shadeBfr, 512 * 512);
+    memcpy(waterBfr, o.waterBfr, 512 * 512);
+    memcpy(waterMark, o.waterMark, 512 * 512);
+    memcpy(tspecBfr, o.tspecBfr, sizeof(uint8_t) << 20);
+    memcpy(plist, o.plist, sizeof(prtType) * MAX_PRT);
+    for (int i=0; i<MAX_PRT; i++) { // links are rebuilt by the next prtHashBuild
+        plist[i].next = NULL;
+        plist[i].cell = -1;
+    }
+}
+
+void gameType::playSound(int _sfx, double rate, double vol) {
+    if (!silent) {
+        ::playSound(_sfx, rate, vol);
+    }
+}
+
+bool gameType::sprCollideTerrain(int _sx, int _sy, int _w, int _h, int dx, int dy) {
+    tmCount.collideCalls += 1;
     uint16_t * it = (uint16_t*)terrainBfr + (dy << 10);
     uint32_t * its = (uint32_t*)sprBfr + (_sy << 10);
     for (int y=0; y<_h; y++) {
@@ -823,22 +1769,69 @@ bool sprCollideTerrain(int _sx, int _sy, int _w, int _h, int dx, int dy) {
     return false;
 }
 
-bool sprCollideTerrain(uint64_t code, int x, int y) {
+bool gameType::sprCollideTerrain(uint64_t code, int x, int y) {
     return sprCollideTerrain(SPR_X(code), SPR_Y(code), SPR_W(code), SPR_H(code), x, y);
 }
 
-void terrainClear() {
+// a to b, exactly b at t = 1
+static inline float sweepLerp(float a, float b, float t) {
+    return t >= 1.f ? b : a + (b - a) * t;
+}
+
+// sprCollideTerrain along the move from x0, y0 to x1, y1 with the sprite's top left at round(x) + ox,
+// round(y) + oy, tested every px but not at the start, so a move of under a px is the one test at
+// the end. toi is the fraction of the move at first touch, nx, ny the rock's normal at the sprite's
+// centre there.
+bool gameType::sprSweepTerrain(uint64_t code, float x0, float y0, float x1, float y1, int ox, int oy, float & toi, float & nx, float & ny) {
+    const int n = MAX(1, (int)ceil(MAX(fabs(x1 - x0), fabs(y1 - y0))));
+    int lx = 0, ly = 0;
+    for (int k=1; k<=n; k++) {
+        const float t = (float)k / (float)n, x = sweepLerp(x0, x1, t), y = sweepLerp(y0, y1, t);
+        const int ix = (int)round(x), iy = (int)round(y);
+        if (k > 1 && ix == lx && iy == ly) {
+            continue;
+        }
+        lx = ix;
+        ly = iy;
+        if (sprCollideTerrain(code, ix + ox, iy + oy)) {
+            toi = t;
+            sdfAt(x + (float)(ox + SPR_W(code) / 2), y + (float)(oy + SPR_H(code) / 2), nx, ny);
+            return true;
+        }
+    }
+    toi = 1.f;
+    nx = ny = 0.f;
+    return false;
+}
+
+void gameType::terrainClear() {
     memset((char *)terrainBfr, 0, sizeof(uint16_t) << 20);
     memset((char *)tspecBfr, 0, sizeof(uint8_t) << 20);
 }
 
-void terrainAdd(uint64_t spr, int cx, int cy, int z, int scale = 100) { // scale = f * 100
+void gameType::terrainAdd(uint64_t spr, int cx, int cy, int z, int scale) { // scale = f * 100
     const int tx = SPR_X(spr),
               ty = SPR_Y(spr),
               tw = SPR_W(spr),
               th = SPR_H(spr);
     int x1 = cx - (tw / 2),
         y1 = cy - (th / 2);
+    int writes = 0;
+    vector<prtType> debris;
+    if (scale < 0) {
+        // lit as it was before any of it goes
+        for (int x=MAX(x1, 0); x<MIN(x1+tw, 512); x++) {
+            for (int y=MAX(y1, 0); y<MIN(y1+th, 512); y++) {
+                uint32_t tclr = sprBfr[x - x1 + tx + ((y-y1+ty)<<10)];
+                int t00 = (int)terrainBfr[x + (y<<10)];
+                if (((tclr >> 24) & 0xFF) > 16u && t00 > 0 && z + ((int)(tclr & 0xFF) * scale / 100) <= 0) {
+                    float dx = (float)x + 0.5f - (float)cx, dy = (float)y + 0.5f - (float)cy,
+                          f = DEBRIS_PUSH * (0.5f + (float)(rngInt(rngPrt) & 0xFF) / 255.f) / MAX(sqrt(dx*dx + dy*dy), 1.f);
+                    debris.push_back(debrisParticle(x, y, dx * f, dy * f));
+                }
+            }
+        }
+    }
     for (int x=x1; x<(x1+tw); x++) {
         if (x<0 || x>1023) {
             continue;
@@ -857,53 +1850,211 @@ void terrainAdd(uint64_t spr, int cx, int cy, int z, int scale = 100) { // scale
                 else {
                     ptr[0] = MIN(ptr[0], c1);
                 }
+                writes += 1;
             }
         }
     }
+    tmCount.terrainWrites += writes;
+    if (scale < 0) {
+        islandCheck(x1, y1, x1 + tw - 1, y1 + th - 1);
+        rockChanged(x1, y1, x1 + tw - 1, y1 + th - 1);
+        wakeParticles(x1 - 1, y1 - 1, x1 + tw, y1 + th);
+        addParticles(debris.data(), (int)debris.size());
+    }
 }
 
-void terrainRender(int cx, int cy) {
-    uint32_t * it = (uint32_t*)bfr64;
-    for (int sy=0; sy<64; sy++) {
-        for (int sx=0; sx<64; sx++) {
-            int x = cx - 32 + sx,
-                y = cy - 32 + sy;
-            if (x >= 0 && y >= 0 && x < 1024 && y < 1024) {
-                int t00 = (int)terrainBfr[x + (y<<10)];
-                int tp0 = x < 1023 ? (int)terrainBfr[x + 1 + (y<<10)] : t00;
-                int tp0x = x < 1022 ? (int)terrainBfr[x + 2 + (y<<10)] : tp0;
-                int tn0 = x > 0 ? (int)terrainBfr[x - 1 + (y<<10)] : t00;
-                int tn0x = x > 1 ? (int)terrainBfr[x - 2 + (y<<10)] : tn0;
-                int t0p = y < 1023 ? (int)terrainBfr[x + ((y+1)<<10)] : t00;
-                int t0px = y < 1022 ? (int)terrainBfr[x + ((y+2)<<10)] : t0p;
-                int t0n = y > 0 ? (int)terrainBfr[x + ((y-1)<<10)] : t00;
-                int t0nx = y > 1 ? (int)terrainBfr[x + ((y-2)<<10)] : t0n;
-                tp0 = (tp0 * 2 + tp0x) / 3;
-                tn0 = (tn0 * 2 + tn0x) / 3;
-                t0p = (t0p * 2 + t0px) / 3;
-                t0n = (t0n * 2 + t0nx) / 3;
-                int shade = 6;
-                if (t00 > 0) {
-                    int l = t00;
-                    int xa = 2 * (tp0 - tn0),
-                        ya = 2 * (t0p - t0n),
-                        za = -4;
-                    int len = xa*xa+ya*ya+za*za;
-                    int dot = ((ya - za - xa) * 65535) / len;
-                    if (curLevel >= 4) {
-                        int shade = CLAMP(dot / 64 + 4, 2, 9);
-                        if (shade > 5) {
-                            it[sx] = PAL_GREEN[shade-3];
-                        }
-                        else {
-                            it[sx] = PAL_GREY[shade+1];
-                        }
-                    }
-                    else {
-                        int shade = CLAMP(dot / 64 + 4, 2, 7);
-                        it[sx] = PAL_GREY[shade];
-                    }
-                }
+// squared distance transform of n samples stride apart (Felzenszwalb & Huttenlocher)
+static void sdfEdt(double * f, int n, int stride, double * d, int * v, double * z) {
+    int k = 0;
+    v[0] = 0;
+    z[0] = -1e30;
+    z[1] = 1e30;
+    for (int q=1; q<n; q++) {
+        double s;
+        while (true) {
+            s = ((f[q*stride] + (double)(q*q)) - (f[v[k]*stride] + (double)(v[k]*v[k]))) / (double)(2*q - 2*v[k]);
+            if (s > z[k] || k == 0) {
+                break;
+            }
+            k -= 1;
+        }
+        k += 1;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = 1e30;
+    }
+    k = 0;
+    for (int q=0; q<n; q++) {
+        while (z[k+1] < (double)q) {
+            k += 1;
+        }
+        d[q] = (double)((q - v[k]) * (q - v[k])) + f[v[k]*stride];
+    }
+    for (int q=0; q<n; q++) {
+        f[q*stride] = d[q];
+    }
+}
+
+// rebuilds the cells that px x1,y1 - x2,y2 (rock just changed there) are within SDF_MAX of
+void gameType::sdfUpdate(int x1, int y1, int x2, int y2) {
+    const int m = (int)SDF_MAX + 1;
+    const int cx1 = CLAMP((x1 - m) / SDF_CELL, 0, SDF_RES-1), cy1 = CLAMP((y1 - m) / SDF_CELL, 0, SDF_RES-1),
+              cx2 = CLAMP((x2 + m) / SDF_CELL, 0, SDF_RES-1), cy2 = CLAMP((y2 + m) / SDF_CELL, 0, SDF_RES-1);
+    // and every px that can be within SDF_MAX of those
+    const int wx1 = MAX(cx1 * SDF_CELL - m, 0), wy1 = MAX(cy1 * SDF_CELL - m, 0),
+              wx2 = MIN(cx2 * SDF_CELL + m, 511), wy2 = MIN(cy2 * SDF_CELL + m, 511);
+    const int w = wx2 - wx1 + 1, h = wy2 - wy1 + 1;
+    const double far = 1e12;
+    vector<double> out(w * h), in(w * h);
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            bool solid = terrainBfr[wx1 + x + ((wy1 + y) << 10)] > 0;
+            out[x + y * w] = solid ? 0. : far;
+            in[x + y * w] = solid ? far : 0.;
+        }
+    }
+    // rows then columns, each line on its own
+    for (int k=0; k<2; k++) {
+        double * f = k ? in.data() : out.data();
+        parallelFor(h, 32, [&](int y1, int y2) {
+            vector<double> d(w), z(w + 1);
+            vector<int> v(w);
+            for (int y=y1; y<y2; y++) {
+                sdfEdt(f + y * w, w, 1, d.data(), v.data(), z.data());
+            }
+        });
+        parallelFor(w, 32, [&](int x1, int x2) {
+            vector<double> d(h), z(h + 1);
+            vector<int> v(h);
+            for (int x=x1; x<x2; x++) {
+                sdfEdt(f + x, h, w, d.data(), v.data(), z.data());
+            }
+        });
+    }
+    const float lim = SDF_MAX * SDF_SCALE;
+    for (int cy=cy1; cy<=cy2; cy++) {
+        for (int cx=cx1; cx<=cx2; cx++) {
+            int i = (cx * SDF_CELL - wx1) + (cy * SDF_CELL - wy1) * w;
+            // px centre to px centre, half a px more than to the edge between them
+            double dist = out[i] > 0. ? sqrt(out[i]) - 0.5 : 0.5 - sqrt(in[i]);
+            sdf[cx + cy * SDF_RES].d = (int8_t)CLAMP((float)round(dist * SDF_SCALE), -lim, lim);
+        }
+    }
+    for (int cy=MAX(cy1-1, 0); cy<=MIN(cy2+1, SDF_RES-1); cy++) {
+        for (int cx=MAX(cx1-1, 0); cx<=MIN(cx2+1, SDF_RES-1); cx++) {
+            const sdfType * c = sdf + cx + cy * SDF_RES;
+            float gx = (float)(c[cx < SDF_RES-1 ? 1 : 0].d - c[cx > 0 ? -1 : 0].d),
+                  gy = (float)(c[cy < SDF_RES-1 ? SDF_RES : 0].d - c[cy > 0 ? -SDF_RES : 0].d),
+                  len = sqrt(gx*gx + gy*gy);
+            sdfType & o = sdf[cx + cy * SDF_RES];
+            o.nx = len > 0.f ? (int8_t)round(gx / len * 127.f) : 0;
+            o.ny = len > 0.f ? (int8_t)round(gy / len * 127.f) : -127;
+        }
+    }
+}
+
+// distance to rock from x, y, negative inside it, and the outward normal
+inline float gameType::sdfAt(float x, float y, float & nx, float & ny) const {
+    int cx = CLAMP((int)x / SDF_CELL, 0, SDF_RES-1), cy = CLAMP((int)y / SDF_CELL, 0, SDF_RES-1);
+    const sdfType & c = sdf[cx + cy * SDF_RES];
+    nx = (float)c.nx / 127.f;
+    ny = (float)c.ny / 127.f;
+    return (float)c.d / SDF_SCALE + nx * (x - (float)(cx * SDF_CELL) - 0.5f) + ny * (y - (float)(cy * SDF_CELL) - 0.5f);
+}
+
+// true if going from ox, oy to x, y runs into rock, x, y are then put back just outside it.
+// Moves of up to a px take the one lookup, longer ones march by the distance to rock so
+// fast sparks can't skip through thin walls.
+bool gameType::sdfCollide(float ox, float oy, float & x, float & y, float & nx, float & ny) const {
+    const float dx = x - ox, dy = y - oy, len = sqrt(dx*dx + dy*dy);
+    float t = len <= 1.f ? len : 0.f;
+    while (true) {
+        float f = len > 0.f ? t / len : 1.f,
+              px = ox + dx * f, py = oy + dy * f,
+              d = sdfAt(px, py, nx, ny);
+        if (d < 0.f) {
+            x = px + nx * (0.05f - d);
+            y = py + ny * (0.05f - d);
+            return true;
+        }
+        if (t >= len) {
+            return false;
+        }
+        t = MIN(t + MAX(d, 0.5f), len);
+    }
+}
+
+// PAL_INDEX of solid px x, y (height t00), lit by the slope of the heights around it
+inline uint8_t gameType::terrainShadeIndex(int x, int y, int t00) const {
+    int tp0 = x < 1023 ? (int)terrainBfr[x + 1 + (y<<10)] : t00;
+    int tp0x = x < 1022 ? (int)terrainBfr[x + 2 + (y<<10)] : tp0;
+    int tn0 = x > 0 ? (int)terrainBfr[x - 1 + (y<<10)] : t00;
+    int tn0x = x > 1 ? (int)terrainBfr[x - 2 + (y<<10)] : tn0;
+    int t0p = y < 1023 ? (int)terrainBfr[x + ((y+1)<<10)] : t00;
+    int t0px = y < 1022 ? (int)terrainBfr[x + ((y+2)<<10)] : t0p;
+    int t0n = y > 0 ? (int)terrainBfr[x + ((y-1)<<10)] : t00;
+    int t0nx = y > 1 ? (int)terrainBfr[x + ((y-2)<<10)] : t0n;
+    tp0 = (tp0 * 2 + tp0x) / 3;
+    tn0 = (tn0 * 2 + tn0x) / 3;
+    t0p = (t0p * 2 + t0px) / 3;
+    t0n = (t0n * 2 + t0nx) / 3;
+    int xa = 2 * (tp0 - tn0),
+        ya = 2 * (t0p - t0n),
+        za = -4;
+    int len = xa*xa+ya*ya+za*za;
+    int dot = ((ya - za - xa) * 65535) / len;
+    if (curLevel >= 4) {
+        int shade = CLAMP(dot / 64 + 4, 2, 9);
+        if (shade > 5) {
+            return (uint8_t)(1 + PAL_ROW_GREEN * 9 + shade-3);
+        }
+        else {
+            return (uint8_t)(1 + PAL_ROW_GREY * 9 + shade+1);
+        }
+    }
+    else {
+        int shade = CLAMP(dot / 64 + 4, 2, 7);
+        return (uint8_t)(1 + PAL_ROW_GREY * 9 + shade);
+    }
+}
+
+// straight from the rock, for px that may have changed since shadeBfr was last brought up to date
+inline uint32_t gameType::terrainShade(int x, int y, int t00) const {
+    return PAL_INDEX[terrainShadeIndex(x, y, t00)];
+}
+
+// lighting looks 2 px each way, so px that far around the box are relit too
+void gameType::shadeUpdate(int x1, int y1, int x2, int y2) {
+    x1 = MAX(x1 - 2, 0); y1 = MAX(y1 - 2, 0);
+    x2 = MIN(x2 + 2, 511); y2 = MIN(y2 + 2, 511);
+    parallelFor(y2 - y1 + 1, 32, [&](int r1, int r2) {
+        for (int y=y1+r1; y<y1+r2; y++) {
+            for (int x=x1; x<=x2; x++) {
+                int t00 = (int)terrainBfr[x + (y<<10)];
+                shadeBfr[x + (y<<9)] = t00 > 0 ? terrainShadeIndex(x, y, t00) : 0;
+            }
+        }
+    });
+}
+
+// everything kept alongside the rock, after px in the box were added or taken away
+void gameType::rockChanged(int x1, int y1, int x2, int y2) {
+    terrainGen += 1;
+    sdfUpdate(x1, y1, x2, y2);
+    shadeUpdate(x1, y1, x2, y2);
+}
+
+void gameType::terrainRender(int cx, int cy) {
+    uint32_t * it = (uint32_t*)bfr64;
+    for (int sy=0; sy<64; sy++) {
+        for (int sx=0; sx<64; sx++) {
+            int x = cx - 32 + sx,
+                y = cy - 32 + sy;
+            if (x >= 0 && y >= 0 && x < 512 && y < 512) {
+                int shade = shadeBfr[x + (y<<9)];
+                if (shade > 0) {
+                    it[sx] = PAL_INDEX[shade];
+                }
                 else if (tspecBfr[x+(y<<10)] == 1) {
                     it[sx] = blend(it[sx], (PAL_GREY[2] & 0x00FFFFFF) | 0x50000000);
                 }
@@ -913,116 +2064,400 @@ void terrainRender(int cx, int cy) {
     }
 }
 
-void clearParticles() {
+// solid px x, y as a debris particle
+prtType gameType::debrisParticle(int x, int y, float xv, float yv) const {
+    prtType p;
+    p.pal = PAL_GREY;
+    p.shadef = 1.f;
+    p.life = DEBRIS_LIFE;
+    p.mass = DEBRIS_MASS;
+    p.energy = 10.f;
+    p.x = (float)x + 0.5f;
+    p.y = (float)y + 0.5f;
+    p.xv = xv;
+    p.yv = yv;
+    p.rock = terrainBfr[x + (y << 10)];
+    p.clr = terrainShade(x, y, p.rock);
+    return p;
+}
+
+static int islandFind(vector<int> & parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Rock just carved from px x1,y1 - x2,y2 may have left pieces with nothing holding them up.
+// Only the ISLAND_REACH px around it are labelled (union-find over 8-connected solid px), a
+// piece reaching the edge of that window or the map counts as held. Pieces that never
+// touched the crater are left alone, the levels have floating rocks of their own.
+void gameType::islandCheck(int x1, int y1, int x2, int y2) {
+    const int wx1 = MAX(x1 - ISLAND_REACH, 0), wy1 = MAX(y1 - ISLAND_REACH, 0),
+              wx2 = MIN(x2 + ISLAND_REACH, 511), wy2 = MIN(y2 + ISLAND_REACH, 511);
+    const int w = wx2 - wx1 + 1, h = wy2 - wy1 + 1;
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+    const int nb[4][2] = { { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } }; // already labelled neighbours
+    vector<int> parent(w * h, -1);
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            int i = x + y * w;
+            if (terrainBfr[wx1 + x + ((wy1 + y) << 10)] == 0) {
+                continue;
+            }
+            parent[i] = i;
+            for (int k=0; k<4; k++) {
+                int nx = x + nb[k][0], ny = y + nb[k][1];
+                if (nx >= 0 && ny >= 0 && nx < w && parent[nx + ny * w] >= 0) {
+                    int a = islandFind(parent, i), b = islandFind(parent, nx + ny * w);
+                    if (a != b) {
+                        parent[MAX(a, b)] = MIN(a, b);
+                    }
+                }
+            }
+        }
+    }
+    // per piece: its root, held, touched the crater, px count & box
+    vector<int> piece(w * h, -1), root, held, cut, count, bx1, by1, bx2, by2;
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            int i = x + y * w;
+            if (parent[i] < 0) {
+                continue;
+            }
+            int r = islandFind(parent, i);
+            if (piece[r] < 0) {
+                piece[r] = (int)root.size();
+                root.push_back(r); held.push_back(0); cut.push_back(0); count.push_back(0);
+                bx1.push_back(x); by1.push_back(y); bx2.push_back(x); by2.push_back(y);
+            }
+            int k = piece[r];
+            int px = wx1 + x, py = wy1 + y;
+            if (x == 0 || y == 0 || x == w-1 || y == h-1 || px == 511 || py == 511) {
+                held[k] = 1;
+            }
+            if (px >= x1 - 1 && py >= y1 - 1 && px <= x2 + 1 && py <= y2 + 1) {
+                cut[k] = 1;
+            }
+            count[k] += 1;
+            bx1[k] = MIN(bx1[k], x); by1[k] = MIN(by1[k], y);
+            bx2[k] = MAX(bx2[k], x); by2[k] = MAX(by2[k], y);
+        }
+    }
+    for (int k=0; k<(int)root.size(); k++) {
+        if (held[k] || !cut[k] || count[k] > ISLAND_MAX_PX) {
+            continue;
+        }
+        int slot = -1;
+        for (int i=0; i<MAX_CHUNKS && slot < 0 && count[k] >= ISLAND_MIN_PX; i++) {
+            slot = chunks[i].exists ? -1 : i;
+        }
+        if (slot < 0) {
+            // too small to fall as a piece, or every chunk slot is taken: crumbles where it is
+            vector<prtType> debris;
+            for (int y=by1[k]; y<=by2[k]; y++) {
+                for (int x=bx1[k]; x<=bx2[k]; x++) {
+                    if (parent[x + y * w] >= 0 && islandFind(parent, x + y * w) == root[k]) {
+                        debris.push_back(debrisParticle(wx1 + x, wy1 + y, 0.f, 0.f));
+                        terrainBfr[wx1 + x + ((wy1 + y) << 10)] = 0;
+                    }
+                }
+            }
+            rockChanged(wx1 + bx1[k], wy1 + by1[k], wx1 + bx2[k], wy1 + by2[k]);
+            addParticles(debris.data(), (int)debris.size());
+            continue;
+        }
+        chunkType & c = chunks[slot];
+        c.exists = true;
+        c.x = wx1 + bx1[k];
+        c.y = (float)(wy1 + by1[k]);
+        c.yv = 0.f;
+        c.w = bx2[k] - bx1[k] + 1;
+        c.h = by2[k] - by1[k] + 1;
+        c.rock.assign(c.w * c.h, 0);
+        c.clr.assign(c.w * c.h, 0);
+        for (int y=0; y<c.h; y++) {
+            for (int x=0; x<c.w; x++) {
+                int i = bx1[k] + x + (by1[k] + y) * w;
+                if (parent[i] >= 0 && islandFind(parent, i) == root[k]) {
+                    int t = c.x + x + (((int)c.y + y) << 10);
+                    c.rock[x + y * c.w] = terrainBfr[t];
+                    c.clr[x + y * c.w] = terrainShade(c.x + x, (int)c.y + y, terrainBfr[t]);
+                }
+            }
+        }
+        for (int i=0; i<c.w*c.h; i++) {
+            if (c.rock[i]) {
+                terrainBfr[c.x + (i % c.w) + (((int)c.y + i / c.w) << 10)] = 0;
+            }
+        }
+        rockChanged(c.x, (int)c.y, c.x + c.w - 1, (int)c.y + c.h - 1);
+        wakeParticles(c.x - 1, (int)c.y - 1, c.x + c.w, (int)c.y + c.h);
+    }
+}
+
+enum { CHUNK_FREE, CHUNK_ROCK, CHUNK_SHIP };
+
+// what chunk c would overlap with its top at row y, the bottom of the map counts as rock
+int gameType::chunkHits(const chunkType & c, int y) {
+    const uint64_t ship = SHIP_OFF[(int)(floor(playerAngle))];
+    const int sx = (int)round(playerX) - 8, sy = (int)round(playerY) - 8;
+    for (int j=0; j<c.h; j++) {
+        int py = y + j;
+        if (py > 511) {
+            return CHUNK_ROCK;
+        }
+        if (py < 0) {
+            continue;
+        }
+        for (int i=0; i<c.w; i++) {
+            if (!c.rock[i + j * c.w]) {
+                continue;
+            }
+            int px = c.x + i;
+            if (terrainBfr[px + (py << 10)] > 0) {
+                return CHUNK_ROCK;
+            }
+            if (!playerDead && px >= sx && py >= sy && px < sx + 16 && py < sy + 16 &&
+                ((sprBfr[SPR_X(ship) + px - sx + ((SPR_Y(ship) + py - sy) << 10)] >> 24) & 0xFF) > 0) {
+                return CHUNK_SHIP;
+            }
+        }
+    }
+    return CHUNK_FREE;
+}
+
+// falls a px at a time and lands on the first rock it would overlap. One that reaches the
+// ship is stamped a px into it, so the ship's own terrain check finds it crushed.
+void gameType::updateRenderChunks(float dt, int cx, int cy) {
+    uint32_t * bfr = (uint32_t*)bfr64;
+    for (int k=0; k<MAX_CHUNKS; k++) {
+        chunkType & c = chunks[k];
+        if (!c.exists) {
+            continue;
+        }
+        c.yv -= c.yv * dt * 0.25f;
+        c.yv += dt * GRAVITY;
+        int y = (int)c.y, to = (int)(c.y + c.yv * dt);
+        int hit = chunkHits(c, y + 1);
+        while (y < to && hit == CHUNK_FREE) {
+            y += 1;
+            hit = chunkHits(c, y + 1);
+        }
+        c.y = hit != CHUNK_FREE ? (float)y : c.y + c.yv * dt;
+        if (hit != CHUNK_FREE) {
+            y += hit == CHUNK_SHIP ? 1 : 0;
+            for (int j=0; j<c.h; j++) {
+                for (int i=0; i<c.w; i++) {
+                    int px = c.x + i, py = y + j;
+                    if (c.rock[i + j * c.w] && py >= 0 && py < 512) {
+                        uint16_t & t = terrainBfr[px + (py << 10)];
+                        t = MAX(t, c.rock[i + j * c.w]);
+                    }
+                }
+            }
+            rockChanged(c.x, y, c.x + c.w - 1, y + c.h - 1);
+            wakeParticles(c.x - 1, y - 1, c.x + c.w, y + c.h);
+            playSound(SFX_LAND, 0.5);
+            flashT += 0.1f;
+            c.exists = false;
+            continue;
+        }
+        for (int j=0; j<c.h; j++) {
+            for (int i=0; i<c.w; i++) {
+                int x = c.x + i - cx + 32, yy = y + j - cy + 32;
+                if (c.rock[i + j * c.w] && x >= 0 && yy >= 0 && x < 64 && yy < 64) {
+                    bfr[x + (yy << 6)] = c.clr[i + j * c.w];
+                }
+            }
+        }
+    }
+}
+
+void gameType::clearParticles() {
     memset(plist, 0, sizeof(prtType) * MAX_PRT);
     memset(phash, 0, sizeof(prtType*) * 512 * 512);
+    for (int i=0; i<MAX_PRT; i++) {
+        plist[i].cell = -1;
+    }
+    prtTop = 0;
+    memset(waterBfr, 0, 512 * 512);
+    memset(waterMark, 0, 512 * 512);
+    waterActive.clear();
+    waterNext.clear();
+    waterCells = 0;
+    waterTick = 0;
 }
 
-void addParticle(prtType p, bool force = false) {
-    for (int i=0; i<MAX_PRT; i++) {
+// one pass over the slots however many go in, returns how many did
+int gameType::addParticles(const prtType * ps, int n, bool force) {
+    int k = 0;
+    for (int i=0; i<MAX_PRT && k<n; i++) {
         if (plist[i].life <= 0.f || (force && plist[i].pal == PAL_BLUE)) {
+            const prtType & p = ps[k++];
+            int cell = plist[i].cell;
             plist[i] = p;
             plist[i].next = NULL;
             plist[i].id = i;
-            return;
+            plist[i].cell = cell;
+            plist[i].restX = p.x;
+            plist[i].restY = p.y;
+            plist[i].still = 0;
+            plist[i].lag = plist[i].step = 0;
+            prtTop = MAX(prtTop, i + 1);
         }
     }
+    return k;
+}
+
+bool gameType::addParticle(const prtType & p, bool force) {
+    return addParticles(&p, 1, force) == 1;
 }
 
-void addFire(float x, float y, float xv, float yv, int cnt = 4, float lifef = 1.0f) {
+prtType gameType::fireParticle(float x, float y, float xv, float yv, float lifef) {
     prtType p;
     p.pal = PAL_RED;
     p.shadef = 1. / lifef;
-    p.life = lifef * (float)((rand() & 0xF) + 32) / 16.f;
+    p.life = lifef * (float)((rngInt(rngPrt) & 0xF) + 32) / 16.f;
     p.mass = 0.1f;
     p.energy = 10.f;
-    p.x = x + (float)(rand() & 0xFF) / 255.f - 0.5f;
-    p.y = y + (float)(rand() & 0xFF) / 255.f - 0.5f;
+    p.x = x + (float)(rngInt(rngPrt) & 0xFF) / 255.f - 0.5f;
+    p.y = y + (float)(rngInt(rngPrt) & 0xFF) / 255.f - 0.5f;
     p.xv = xv;
     p.yv = yv;
+    p.rock = 0;
+    p.clr = 0;
+    return p;
+}
+
+void gameType::addFire(float x, float y, float xv, float yv, int cnt, float lifef) {
+    prtType p = fireParticle(x, y, xv, yv, lifef);
     for (int i=0; i<cnt; i++) {
         addParticle(p, true);
     }
 }
 
-void addWater(float x, float y, float xv, float yv, int cnt = 8, float lifef = 5.0f) {
+void gameType::addWater(float x, float y, float xv, float yv, int cnt, float lifef) {
     prtType p;
     p.pal = PAL_BLUE;
     p.shadef = 1. / lifef;
-    p.life = lifef * (float)((rand() & 0xF) + 32) / 16.f;
+    p.life = lifef * (float)((rngInt(rngPrt) & 0xF) + 32) / 16.f;
     p.mass = 0.1f;
     p.energy = 10.f;
-    p.x = x + ((float)(rand() & 0xFF) / 255.f - 0.5f) * 2.f;
-    p.y = y + ((float)(rand() & 0xFF) / 255.f - 0.5f) * 2.f;
+    p.x = x + ((float)(rngInt(rngPrt) & 0xFF) / 255.f - 0.5f) * 2.f;
+    p.y = y + ((float)(rngInt(rngPrt) & 0xFF) / 255.f - 0.5f) * 2.f;
     p.xv = xv;
     p.yv = yv;
+    p.rock = 0;
+    p.clr = 0;
     for (int i=0; i<cnt; i++) {
         addParticle(p);
     }
 }
 
-void explosion(float x, float y, float xv, float yv, int cnt) {
+// 4 fire particles from each of cnt points (fewer at lower quality), spawned in one go
+void gameType::explosion(float x, float y, float xv, float yv, int cnt) {
     float fs = (float)cnt / 256.f;
+    cnt = MAX(1, (int)((float)cnt * quality.spawn));
+    vector<prtType> fire(cnt * 4);
     for (int k=0; k<cnt; k++) {
-        float vx = 3.f * ((float)(rand() & 0xFF) / 255.f - 0.5f);
-        float vy = 3.f * ((float)(rand() & 0xFF) / 255.f - 0.5f);
-        addFire(x + vx, y + vy, xv + vx * 15.f * fs, yv + vy * 50.f * fs, 4, 2.5f);
+        float vx = 3.f * ((float)(rngInt(rngPrt) & 0xFF) / 255.f - 0.5f);
+        float vy = 3.f * ((float)(rngInt(rngPrt) & 0xFF) / 255.f - 0.5f);
+        fire[k*4] = fire[k*4+1] = fire[k*4+2] = fire[k*4+3] = fireParticle(x + vx, y + vy, xv + vx * 15.f * fs, yv + vy * 50.f * fs, 2.5f);
     }
+    addParticles(fire.data(), cnt * 4, true);
 }
 
-void updateRenderParticles(float dt, int cx, int cy) {
-    memset(phash, 0, sizeof(prtType*) * 512 * 512);
-    for (int i=0; i<MAX_PRT; i++) {
+static inline void prtLod(prtType & p, int cx, int cy, float dt, const qualityType & q) {
+    p.lag += 1;
+    int d = MAX(abs((int)p.x - cx), abs((int)p.y - cy));
+    int every = d < q.lodNear ? 1 : (d < q.lodFar ? 2 : 4);
+    if (MAX(fabs(p.xv), fabs(p.yv)) * dt * (float)every > PRT_LOD_MAX_MOVE) {
+        every = 1;
+    }
+    p.step = p.lag >= every ? p.lag : 0;
+    p.lag = p.step ? 0 : p.lag;
+}
+
+// links every live particle into phash where it is now, before this tick's passes read it.
+// Only the slots used last frame are unlinked, clearing all 512x512 of phash dominates headless stepping
+void gameType::prtHashBuild() {
+    for (int i=0; i<prtTop; i++) {
+        if (plist[i].cell >= 0) {
+            phash[plist[i].cell] = NULL;
+            plist[i].cell = -1;
+        }
+    }
+    while (prtTop > 0 && plist[prtTop-1].life <= 0.f) {
+        prtTop --;
+    }
+    for (int i=0; i<prtTop; i++) {
         plist[i].next = NULL;
         if (plist[i].life > 0.f) {
             int hx = (int)floor(plist[i].x), hy = (int)floor(plist[i].y);
             if (hx >= 0 && hy >= 0 && hx < 512 && hy < 512) {
                 int hi = hx + (hy << 9);
                 plist[i].next = phash[hi];
+                plist[i].cell = hi;
                 phash[hi] = plist + i;
             }
         }
     }
-    for (int i=0; i<MAX_PRT; i++) {
+}
+
+// phash has to be fresh from prtHashBuild, draw is false for all but a tick's last step
+void gameType::updateRenderParticles(float dt, int cx, int cy, bool draw) {
+    for (int i=0; i<prtTop; i++) {
         if (plist[i].life > 0.f) {
             plist[i].life -= dt;
             if (plist[i].life < 0.f) {
                 plist[i].life = 0.f;
             }
-            else {
+            else if (plist[i].still < PRT_SLEEP_FRAMES) {
+                prtLod(plist[i], cx, cy, dt, quality);
+                if (plist[i].step == 0) {
+                    continue;
+                }
+                const float pdt = dt * (float)plist[i].step;
                 float dampf = 0.25f;
                 if (plist[i].pal == PAL_BLUE) {
                     dampf = 0.025f;
                 }
-                plist[i].xv -= plist[i].xv * dt * dampf;
-                plist[i].yv -= plist[i].yv * dt * dampf;
-                plist[i].yv += dt * GRAVITY;
+                plist[i].xv -= plist[i].xv * pdt * dampf;
+                plist[i].yv -= plist[i].yv * pdt * dampf;
+                plist[i].yv += pdt * GRAVITY;
                 if (plist[i].pal == PAL_BLUE) {
-                    plist[i].yv += dt * GRAVITY;
+                    plist[i].yv += pdt * GRAVITY;
                 }
                 int hx = (int)floor(plist[i].x), hy = (int)floor(plist[i].y);
-                for (int x=hx-1; x<=hx+1; x++) {
-                    for (int y=hy-1; y<=hy+1; y++) {
+                int pushes = quality.forceCap > 0 ? quality.forceCap : MAX_PRT;
+                for (int x=hx-1; x<=hx+1 && pushes > 0; x++) {
+                    for (int y=hy-1; y<=hy+1 && pushes > 0; y++) {
                         if (x>=0 && y>=0 && x<512 && y<512) {
                             prtType * n = phash[x+(y<<9)];
-                            while (n != NULL) {
+                            while (n != NULL && pushes > 0) {
                                 if (n->id != plist[i].id) {
                                     double dx = plist[i].x - n->x,
                                            dy = plist[i].y - n->y;
                                     double m1 = plist[i].mass, m2 = n->mass;
                                     double len = dx*dx+dy*dy;
                                     if (len < 1.) {
+                                        pushes -= 1;
                                         len = sqrt(len) + 0.1;
                                         dx /= len;
                                         dy /= len;
-                                        double force = pow(1. / len, 3.);
+                                        double il = 1. / len; double force = il * il * il; // rounds differently to pow(il, 3.) now and then
                                         if (plist[i].pal == PAL_BLUE) {
                                             force *= 0.5f;
                                         }
-                                        plist[i].xv += dx * force * (m2 / (m1 + m2)) * dt;
-                                        plist[i].yv += dy * force * (m2 / (m1 + m2)) * dt;
-                                        n->xv -= dx * force * (m1 / (m1 + m2)) * dt;
-                                        n->yv -= dy * force * (m1 / (m1 + m2)) * dt;
+                                        double fi = n->still >= PRT_SLEEP_FRAMES ? force * 2. : force; // sleepers skip their own pass
+                                        plist[i].xv += dx * fi * (m2 / (m1 + m2)) * pdt;
+                                        plist[i].yv += dy * fi * (m2 / (m1 + m2)) * pdt;
+                                        n->xv -= dx * force * (m1 / (m1 + m2)) * pdt;
+                                        n->yv -= dy * force * (m1 / (m1 + m2)) * pdt;
                                     }
                                 }
                                 n = n->next;
@@ -1034,27 +2469,85 @@ void updateRenderParticles(float dt, int cx, int cy) {
         }
     }
     uint32_t * bfr = (uint32_t*)bfr64;
-    for (int i=0; i<MAX_PRT; i++) {
+    int bx1 = 512, by1 = 512, bx2 = -1, by2 = -1; // debris baked this frame
+    for (int i=0; i<prtTop; i++) {
         if (plist[i].life > 0.f) {
+            bool asleep = plist[i].still >= PRT_SLEEP_FRAMES;
+            if (asleep && (plist[i].xv*plist[i].xv + plist[i].yv*plist[i].yv) > PRT_WAKE_SPEED*PRT_WAKE_SPEED) {
+                plist[i].still = 0; // knocked by a neighbour this frame
+                plist[i].lag = 0;
+                plist[i].step = 1;
+                asleep = false;
+            }
+            const bool moves = !asleep && plist[i].step > 0;
+            const float pdt = dt * (float)plist[i].step;
             float ox = plist[i].x, oy = plist[i].y;
-            plist[i].x += plist[i].xv * dt;
-            plist[i].y += plist[i].yv * dt;
+            if (asleep) {
+                plist[i].xv = plist[i].yv = 0.f;
+            }
+            else if (moves) {
+                plist[i].x += plist[i].xv * pdt;
+                plist[i].y += plist[i].yv * pdt;
+            }
             int x = (int)floor(plist[i].x) - cx + 32,
                 y = (int)floor(plist[i].y) - cy + 32;
-            if (x >= 0 && y >= 0 && x < 64 && y < 64) {
+            if (draw && x >= 0 && y >= 0 && x < 64 && y < 64) {
                 int off = x + (y << 6);
                 if (plist[i].pal == PAL_BLUE) {
                     bfr[off] = blend(bfr[off], (plist[i].pal[CLAMP((int)floor(plist[i].life * plist[i].shadef * 3.), 5, 8)] & 0x00FFFFFF) | (CLAMP((uint32_t)floor(plist[i].life * 255.), 0, 128) << 24u));
                 }
+                else if (plist[i].rock) {
+                    bfr[off] = blend(bfr[off], (plist[i].clr & 0x00FFFFFF) | (CLAMP((uint32_t)floor(plist[i].life * 255.), 0, 255) << 24u));
+                }
                 else {
                     bfr[off] = blend(bfr[off], (plist[i].pal[CLAMP((int)floor(plist[i].life * plist[i].shadef * 3.), 1, 7)] & 0x00FFFFFF) | (CLAMP((uint32_t)floor(plist[i].life * 255.), 0, 255) << 24u));
                 }
             }
+            if (!moves) {
+                continue;
+            }
             int hx = (int)floor(plist[i].x), hy = (int)floor(plist[i].y);
+            float nx, ny;
             if (hx < 0 || hy < 0 || hx >= 512 || hy >= 512) {
                 plist[i].life = 0.f;
+                continue;
+            }
+            else if (sdfCollide(ox, oy, plist[i].x, plist[i].y, nx, ny)) {
+                // bounce off along the normal, lose some of the slide
+                float damp = plist[i].pal == PAL_BLUE ? 0.25f : 0.5f;
+                float vn = plist[i].xv * nx + plist[i].yv * ny;
+                if (vn < 0.f) {
+                    float tx = plist[i].xv - vn * nx, ty = plist[i].yv - vn * ny;
+                    plist[i].xv = tx * (1.f - damp) - vn * damp * nx;
+                    plist[i].yv = ty * (1.f - damp) - vn * damp * ny;
+                }
+                if (plist[i].rock && -ny >= DEBRIS_FLOOR &&
+                    (plist[i].xv*plist[i].xv + plist[i].yv*plist[i].yv) < DEBRIS_SETTLE*DEBRIS_SETTLE) {
+                    // back into the rock, unless it's under the ship (it waits) or there's no room
+                    int x = (int)floor(plist[i].x), y = (int)floor(plist[i].y);
+                    if (fabs(plist[i].x - playerX) >= 8.f || fabs(plist[i].y - playerY) >= 8.f) {
+                        for (int k=0; k<2 && x >= 0 && y > 0 && x < 512 && y < 512 && terrainBfr[x + (y << 10)] > 0; k++) {
+                            y -= 1; // the field is smoother than the px, it can rest a little inside
+                        }
+                        if (x >= 0 && y >= 0 && x < 512 && y < 512 && terrainBfr[x + (y << 10)] == 0 && !waterBfr[x + (y << 9)]) {
+                            terrainBfr[x + (y << 10)] = plist[i].rock;
+                            bx1 = MIN(bx1, x); by1 = MIN(by1, y);
+                            bx2 = MAX(bx2, x); by2 = MAX(by2, y);
+                        }
+                        plist[i].life = 0.f;
+                        continue;
+                    }
+                }
             }
-            else if (terrainBfr[hx + (hy << 10)] > 0) {
+            else if (waterBfr[hx + (hy << 9)]) {
+                if (plist[i].pal == PAL_BLUE) {
+                    // ran into a pool, joins it or is lost if it came from under a full one
+                    int ohx = CLAMP((int)floor(ox), 0, 511), ohy = CLAMP((int)floor(oy), 0, 511);
+                    if (waterPool(plist[i]) || waterBfr[ohx + (ohy << 9)]) {
+                        plist[i].life = 0.f;
+                        continue;
+                    }
+                }
                 plist[i].x = ox;
                 plist[i].y = oy;
                 float damp = 0.5f;
@@ -1070,28 +2563,267 @@ void updateRenderParticles(float dt, int cx, int cy) {
                     plist[i].yv -= plist[i].yv * damp;
                 }
             }
+            if (plist[i].pal == PAL_BLUE && plist[i].life > 0.f) {
+                if (fabs(plist[i].x - plist[i].restX) > PRT_SLEEP_BOX || fabs(plist[i].y - plist[i].restY) > PRT_SLEEP_BOX) {
+                    plist[i].restX = plist[i].x;
+                    plist[i].restY = plist[i].y;
+                    plist[i].still = 0;
+                }
+                else if ((plist[i].still += plist[i].step) >= PRT_SLEEP_FRAMES) {
+                    plist[i].xv = plist[i].yv = 0.f;
+                    if (waterPool(plist[i])) {
+                        plist[i].life = 0.f;
+                    }
+                }
+            }
+        }
+    }
+    if (bx2 >= 0) {
+        rockChanged(bx1, by1, bx2, by2);
+    }
+}
+
+// sleepers never move so last frame's phash links still find them, pooled water inside turns
+// back into particles and the pool around it gets to flow again
+void gameType::wakeParticles(int x1, int y1, int x2, int y2) {
+    x1 = MAX(x1, 0); y1 = MAX(y1, 0);
+    x2 = MIN(x2, 511); y2 = MIN(y2, 511);
+    for (int y=y1; y<=y2; y++) {
+        for (int x=x1; x<=x2; x++) {
+            for (prtType * n = phash[x+(y<<9)]; n != NULL; n = n->next) {
+                n->still = 0;
+            }
+            uint8_t & w = waterBfr[x+(y<<9)];
+            if (w) {
+                prtType p;
+                p.pal = PAL_BLUE;
+                p.shadef = 1. / 5.;
+                p.life = (float)(w * WATER_UNIT_FRAMES) / (float)BASE_HZ;
+                p.mass = 0.1f;
+                p.energy = 10.f;
+                p.x = (float)x + 0.5f;
+                p.y = (float)y + 0.5f;
+                p.xv = p.yv = 0.f;
+                p.rock = 0;
+                p.clr = 0;
+                if (addParticle(p)) {
+                    w = 0;
+                    waterCells -= 1;
+                }
+            }
+        }
+    }
+    if (waterCells > 0) {
+        for (int y=y1-1; y<=y2+1; y++) {
+            for (int x=x1-1; x<=x2+1; x++) {
+                waterQueue(x, y);
+            }
+        }
+    }
+}
+
+inline bool gameType::waterFree(int x, int y) {
+    return x >= 0 && x < 512 && y >= 0 && y < 512 && terrainBfr[x + (y << 10)] == 0 && waterBfr[x + (y << 9)] == 0;
+}
+
+void gameType::waterQueue(int x, int y) {
+    if (x >= 0 && y >= 0 && x < 512 && y < 512) {
+        int i = x + (y << 9);
+        if (waterBfr[i] && !(waterMark[i] & WATER_QUEUED)) {
+            waterMark[i] |= WATER_QUEUED;
+            waterNext.push_back(i);
+        }
+    }
+}
+
+// a settled water particle joins the pool under it, false if there's no room
+bool gameType::waterPool(const prtType & p) {
+    int x = (int)floor(p.x), y = (int)floor(p.y);
+    if (x < 0 || x > 511 || y > 511) {
+        return false;
+    }
+    for (int k=0; k<=WATER_STACK && y>=0; k++, y--) {
+        if (terrainBfr[x + (y << 10)] > 0) {
+            return false;
+        }
+        int i = x + (y << 9);
+        if (!waterBfr[i]) {
+            waterBfr[i] = (uint8_t)CLAMP((int)ceil(p.life * (float)BASE_HZ / (float)WATER_UNIT_FRAMES), 1, 255);
+            waterCells += 1;
+            waterQueue(x, y);
+            return true;
+        }
+    }
+    return false;
+}
+
+// one BASE_HZ step of the pools, draw is false for all but a tick's last step
+void gameType::updateRenderWater(int cx, int cy, bool draw) {
+    if (waterCells <= 0) {
+        return;
+    }
+    waterTick += 1;
+
+    // age a few rows a tick, every row comes round once a unit
+    int y0 = (waterTick * WATER_SWEEP_ROWS) & 511;
+    for (int y=y0; y<y0+WATER_SWEEP_ROWS; y++) {
+        for (int x=0; x<512; x++) {
+            uint8_t & w = waterBfr[x + (y << 9)];
+            if (w && --w == 0) {
+                waterCells -= 1;
+                waterQueue(x - 1, y - 1); waterQueue(x, y - 1); waterQueue(x + 1, y - 1);
+                waterQueue(x - 1, y); waterQueue(x + 1, y);
+            }
+        }
+    }
+
+    // fall, slide, or flow up to WATER_FLOW px towards a drop, one px a tick
+    waterActive.swap(waterNext);
+    waterNext.clear();
+    for (int k=0; k<(int)waterActive.size(); k++) {
+        waterMark[waterActive[k]] &= ~WATER_QUEUED;
+    }
+    int moved = 0;
+    for (int k=0; k<(int)waterActive.size(); k++) {
+        int i = waterActive[k];
+        if (!waterBfr[i] || (waterMark[i] & WATER_MOVED)) {
+            continue;
+        }
+        int x = i & 511, y = i >> 9, to = -1;
+        const int dir = ((x + waterTick) & 1) ? 1 : -1;
+        if (y == 511) {
+            waterBfr[i] = 0; // off the bottom of the world
+            waterCells -= 1;
+        }
+        else if (waterFree(x, y + 1)) {
+            to = i + 512;
+        }
+        else if (waterFree(x + dir, y + 1)) {
+            to = i + 512 + dir;
+        }
+        else if (waterFree(x - dir, y + 1)) {
+            to = i + 512 - dir;
+        }
+        else {
+            for (int s=0; s<2 && to<0; s++) {
+                int d = s ? -dir : dir;
+                for (int f=1; f<=WATER_FLOW && waterFree(x + d * f, y); f++) {
+                    if (waterFree(x + d * f, y + 1)) {
+                        to = i + d;
+                        break;
+                    }
+                }
+            }
+        }
+        if (to >= 0) {
+            waterBfr[to] = waterBfr[i];
+            waterBfr[i] = 0;
+            waterMark[to] |= WATER_MOVED;
+            waterActive[moved++] = to; // k >= moved, this slot's been read
+            waterQueue(to & 511, to >> 9);
+        }
+        if (!waterBfr[i]) {
+            waterQueue(x - 1, y - 1); waterQueue(x, y - 1); waterQueue(x + 1, y - 1);
+            waterQueue(x - 1, y); waterQueue(x + 1, y);
+        }
+    }
+    for (int k=0; k<moved; k++) {
+        waterMark[waterActive[k]] &= ~WATER_MOVED;
+    }
+    if (!draw) {
+        return;
+    }
+
+    uint32_t * bfr = (uint32_t*)bfr64;
+    for (int sy=0; sy<64; sy++) {
+        int y = cy - 32 + sy;
+        if (y < 0 || y >= 512) {
+            continue;
+        }
+        for (int sx=0; sx<64; sx++) {
+            int x = cx - 32 + sx;
+            if (x >= 0 && x < 512 && waterBfr[x + (y << 9)]) {
+                float life = (float)(waterBfr[x + (y << 9)] * WATER_UNIT_FRAMES) / (float)BASE_HZ;
+                bfr[sx + (sy << 6)] = blend(bfr[sx + (sy << 6)], (PAL_BLUE[CLAMP((int)floor(life * 0.6f), 5, 8)] & 0x00FFFFFF) | (CLAMP((uint32_t)floor(life * 255.), 0, 192) << 24u));
+            }
         }
     }
 }
 
-float waterCountInRadius(float x, float y, float r) {
+float gameType::waterCountInRadius(float x, float y, float r) {
     float ret = 0.f;
     float r2 = r * r;
-    for (int i=0; i<MAX_PRT; i++) {
+    for (int i=0; i<prtTop; i++) {
         if (plist[i].life > 1.f && plist[i].pal == PAL_BLUE) {
             if (((x-plist[i].x)*(x-plist[i].x)+(y-plist[i].y)*(y-plist[i].y)) < r2) {
                 ret += 1.f;
             }
         }
     }
+    if (waterCells > 0) {
+        for (int py=MAX((int)floor(y - r), 0); py<=MIN((int)ceil(y + r), 511); py++) {
+            for (int px=MAX((int)floor(x - r), 0); px<=MIN((int)ceil(x + r), 511); px++) {
+                float dx = (float)px + 0.5f - x, dy = (float)py + 0.5f - y;
+                if (waterBfr[px + (py << 9)] > 1 && (dx*dx + dy*dy) < r2) {
+                    ret += 1.f;
+                }
+            }
+        }
+    }
     return ret;
 }
 
-float waterPercentInRadius(float x, float y, float r) {
+float gameType::waterPercentInRadius(float x, float y, float r) {
     return CLAMP(waterCountInRadius(x,y,r) / (PI * r * r), 0.f, 1.f);
 }
 
-void initLevel(int _levelNo) {
+// buoyancy & drag from how much of the hull is wet, and a momentum exchange with every water
+// particle in it: they're dragged along and shoved out, the harder the faster the ship goes.
+// Only the hull's px are looked up in phash, so it costs the same however much water there is.
+void gameType::shipWater(float dt) {
+    const uint64_t hull = SHIP_OFF[(int)floor(playerAngle)];
+    const int ox = (int)round(playerX) - 8, oy = (int)round(playerY) - 8;
+    const uint32_t * its = sprBfr + SPR_X(hull) + (SPR_Y(hull) << 10);
+    const float couple = MIN(SHIP_WATER_COUPLE * dt, 1.f),
+                push = (SHIP_WATER_PUSH + sqrt(playerVX*playerVX + playerVY*playerVY) * SHIP_SPLASH) * dt;
+    int hullPx = 0, wetPx = 0;
+    float ix = 0.f, iy = 0.f;
+    for (int y=0; y<SPR_H(hull); y++) {
+        for (int x=0; x<SPR_W(hull); x++) {
+            int wx = ox + x, wy = oy + y;
+            if (((its[x + (y << 10)] >> 24) & 0xFF) == 0 || wx < 0 || wy < 0 || wx > 511 || wy > 511) {
+                continue;
+            }
+            hullPx += 1;
+            bool wet = waterBfr[wx + (wy << 9)] != 0;
+            for (prtType * n = phash[wx + (wy << 9)]; n != NULL; n = n->next) {
+                if (n->life <= 0.f || n->pal != PAL_BLUE) {
+                    continue;
+                }
+                float dx = n->x - playerX, dy = n->y - playerY,
+                      len = sqrt(dx*dx + dy*dy) + 0.5f;
+                float dvx = (playerVX - n->xv) * couple + dx / len * push,
+                      dvy = (playerVY - n->yv) * couple + dy / len * push;
+                n->xv += dvx;
+                n->yv += dvy;
+                ix -= dvx * n->mass;
+                iy -= dvy * n->mass;
+                wet = true;
+            }
+            wetPx += wet ? 1 : 0;
+        }
+    }
+    if (hullPx > 0 && wetPx > 0) {
+        const float under = (float)wetPx / (float)hullPx;
+        playerVX += ix / SHIP_WATER_MASS;
+        playerVY += iy / SHIP_WATER_MASS;
+        playerVY -= under * GRAVITY * SHIP_BUOYANCY * dt;
+        playerVX -= playerVX * under * SHIP_WATER_DRAG * dt;
+        playerVY -= playerVY * under * SHIP_WATER_DRAG * dt;
+    }
+}
+
+void gameType::initLevel(int _levelNo) {
     const int idx = _levelNo - 1;
     
     curLevel = _levelNo;
@@ -1100,15 +2832,22 @@ void initLevel(int _levelNo) {
 
     const uint8_t * grid = LEVELS[idx];
 
-    srand(_levelNo * 100);
-
-    memset(depots, 0, sizeof(depotType) * MAX_DEPOT);
-    memset(bombPickups, 0, sizeof(bombPickupType) * MAX_BOMB_PICKUP);
-    memset(bombs, 0, sizeof(bombType) * MAX_BOMBS);
-    memset(spouts, 0, sizeof(waterSpoutType) * MAX_SPOUT);
+    rngSeed(rngLevel, _levelNo * 100);
+    rngSeed(rngPrt, _levelNo * 100 + 1);
+    rngSeed(rngFx, _levelNo * 100 + 2);
+
+    depots.clear();
+    bombPickups.clear();
+    bombs.clear();
+    spouts.clear();
+    entDirty = true;
+    for (int i=0; i<MAX_CHUNKS; i++) {
+        chunks[i].exists = false;
+        chunks[i].rock.clear();
+        chunks[i].clr.clear();
+    }
 
     int tnz = 0;
-    int depotI = 0, bombI = 0, spoutI = 0;
     for (int x=0; x<64; x++) {
         for (int y=0; y<64; y++) {
             const int v = grid[x+(y<<6)];
@@ -1122,186 +2861,3076 @@ void initLevel(int _levelNo) {
                 flagVis = true;
             }
             else if (v == 3) { // fuel depot
-                if (depotI < MAX_DEPOT) {
-                    depots[depotI].exists = true;
-                    depots[depotI].fuel = 1.;
-                    depots[depotI].x = 4.f + 8.f * (float)x;
-                    depots[depotI].y = 4.f + 8.f * (float)y;
-                    depotI += 1;
-                }
+                depotType d;
+                d.id = (int)depots.size();
+                d.fuel = 1.;
+                d.x = 4.f + 8.f * (float)x;
+                d.y = 4.f + 8.f * (float)y;
+                depots.push_back(d);
             }
             else if (v == 4) { // bomb
-                if (bombI < MAX_BOMBS) {
-                    bombPickups[bombI].exists = true;
-                    bombPickups[bombI].available = true;
-                    bombPickups[bombI].x = 4.f + 8.f * (float)x;
-                    bombPickups[bombI].y = 4.f + 8.f * (float)y;
-                    bombI += 1;
-                }
+                bombPickupType b;
+                b.id = (int)bombPickups.size();
+                b.available = true;
+                b.x = 4.f + 8.f * (float)x;
+                b.y = 4.f + 8.f * (float)y;
+                bombPickups.push_back(b);
+            }
+            else if (v == 5) { // water spout
+                waterSpoutType w;
+                w.x = 4.f + 8.f * (float)x;
+                w.y = 4.f + 8.f * (float)y;
+                spouts.push_back(w);
+            }
+        }
+    }
+
+    for (int i=0; i<(tnz<<5); i++) {
+        int cx = rngInt(rngLevel)&511,
+            cy = rngInt(rngLevel)&511;
+        if (grid[(cx>>3)+((cy>>3)<<6)] != 1) {
+            i --;
+            continue;
+        }
+        uint64_t spr = ROCKS[rngInt(rngLevel)%N_ROCKS];
+        int w = SPR_W(spr),
+            h = SPR_H(spr);
+        bool any = false;
+        for (int x=cx-(w>>1); x<cx+(w>>1); x++) {
+            for (int y=cy-(h>>1); y<cy+(h>>1); y++) {
+                if (x>=0 && y>=0) {
+                    int lx = x>>3,
+                        ly = y>>3;
+                    if (lx < 64 && ly < 64) {
+                        if (grid[lx+(ly<<6)] != 1) {
+                            any = true;
+                        }
+                    }
+                    else {
+                        any = true;
+                    }
+                }
+                else {
+                    any = true;
+                }
+            }
+        }
+        if (!any) {
+            terrainAdd(spr, cx, cy, 64 + (rngInt(rngLevel) & 63));
+        }
+    }
+
+    for (int i=0; i<((1024<<10)>>7); i++) {
+        long j = (long)(rngInt(rngLevel) & ((1u << 20u)-1u));
+        tspecBfr[j] = 1;
+    }
+    rockChanged(0, 0, 511, 511);
+
+    playerX = (float)(LEVEL_START_X[idx] * 8 + 4);
+    playerY = (float)(LEVEL_START_Y[idx] * 8 + 4);
+    playerVX = 0.f;
+    playerVY = 0.f;
+    playerAngle = 0.f;
+    playerDead = false;
+    playerFuel = 1.f;
+    if (curLevel == 6) {
+        playerFuel = 0.6f;
+    }
+    playerBombs = 0;
+    waterLogged = 0.25f;
+    beatLevel = false;
+}
+
+// thrust, turning, drag & gravity for one tick, returns true if the engine fired
+static bool shipIntegrate(float & x, float & y, float & vx, float & vy, float & angle, float & fuel, const inputType & in, double dt) {
+    bool fired = false;
+    if (in.up && fuel > 0.f) {
+        fired = true;
+        float a = (floorf(angle) / 8.f) * PI * 2.f - PI * 0.5f;
+        vx += cos(a) * dt * PLAYER_THRUST;
+        vy += sin(a) * dt * PLAYER_THRUST;
+        fuel -= dt / FUEL_TANK_CAPACITY;
+    }
+    if (in.left) {
+        angle -= dt * PLAYER_TURN_SPEED;
+    }
+    if (in.right) {
+        angle += dt * PLAYER_TURN_SPEED;
+    }
+    angle = fmodf(angle + 8.f * 100.f, 8.f);
+
+    vx -= vx * dt * 0.25f;
+    vy -= vy * dt * 0.25f;
+    vy += dt * GRAVITY;
+    x += vx * dt;
+    y += vy * dt;
+    return fired;
+}
+
+static inline int entCell(float x, float y) {
+    return CLAMP((int)floor(x / (float)ENT_CELL), 0, ENT_GRID-1) + CLAMP((int)floor(y / (float)ENT_CELL), 0, ENT_GRID-1) * ENT_GRID;
+}
+
+// counting sort of the depots & pickups into their cells, only when they've changed
+void gameType::entIndex() {
+    if (!entDirty) {
+        return;
+    }
+    entDirty = false;
+    entStart.assign(ENT_GRID * ENT_GRID + 1, 0);
+    entList.resize(depots.size() + bombPickups.size());
+    for (int i=0; i<(int)depots.size(); i++) {
+        entStart[entCell(depots[i].x, depots[i].y) + 1] += 1;
+    }
+    for (int i=0; i<(int)bombPickups.size(); i++) {
+        entStart[entCell(bombPickups[i].x, bombPickups[i].y) + 1] += 1;
+    }
+    for (int c=0; c<ENT_GRID*ENT_GRID; c++) {
+        entStart[c+1] += entStart[c];
+    }
+    vector<int> fill(entStart.begin(), entStart.end() - 1);
+    for (int i=0; i<(int)depots.size(); i++) {
+        entList[fill[entCell(depots[i].x, depots[i].y)]++] = (i << 1) | ENT_DEPOT;
+    }
+    for (int i=0; i<(int)bombPickups.size(); i++) {
+        entList[fill[entCell(bombPickups[i].x, bombPickups[i].y)]++] = (i << 1) | ENT_PICKUP;
+    }
+}
+
+// pool indices of the kind (ENT_*) closer than r to x, y, in placement order
+void gameType::entNear(int kind, float x, float y, float r, vector<int> & out) {
+    entIndex();
+    out.clear();
+    const int c1 = entCell(x - r, y - r), c2 = entCell(x + r, y + r);
+    for (int cy=c1/ENT_GRID; cy<=c2/ENT_GRID; cy++) {
+        for (int cx=c1%ENT_GRID; cx<=c2%ENT_GRID; cx++) {
+            const int c = cx + cy * ENT_GRID;
+            for (int k=entStart[c]; k<entStart[c+1]; k++) {
+                if ((entList[k] & 1) != kind) {
+                    continue;
+                }
+                int i = entList[k] >> 1;
+                float ex = kind == ENT_DEPOT ? depots[i].x : bombPickups[i].x,
+                      ey = kind == ENT_DEPOT ? depots[i].y : bombPickups[i].y;
+                if (sqrt((x-ex)*(x-ex)+(y-ey)*(y-ey)) < r) {
+                    out.push_back(i);
+                }
+            }
+        }
+    }
+    if (kind == ENT_DEPOT) {
+        std::sort(out.begin(), out.end(), [&](int a, int b) { return depots[a].id < depots[b].id; });
+    }
+    else {
+        std::sort(out.begin(), out.end(), [&](int a, int b) { return bombPickups[a].id < bombPickups[b].id; });
+    }
+}
+
+// depots within 7 px of a blast at x, y go up with it, as do pickups within pickupR that
+// haven't been taken. Pickups caught in it are gone either way.
+void gameType::blastObjects(float x, float y, float pickupR, float pickupFlash) {
+    vector<int> hit;
+    entNear(ENT_DEPOT, x, y, 7.f, hit);
+    for (int k=0; k<(int)hit.size(); k++) {
+        const depotType & d = depots[hit[k]];
+        explosion(d.x, d.y, 0.f, 0.f, 128);
+        flashT += 0.5f;
+        terrainAdd(EX_BIG, (int)d.x, (int)d.y, 0, -400);
+    }
+    entRemove(depots, hit);
+    entNear(ENT_PICKUP, x, y, pickupR, hit);
+    for (int k=0; k<(int)hit.size(); k++) {
+        const bombPickupType & b = bombPickups[hit[k]];
+        if (b.available) {
+            explosion(b.x, b.y, 0.f, 0.f, 256);
+            flashT += pickupFlash;
+            terrainAdd(EX_HUGE, (int)b.x, (int)b.y, 0, -400);
+        }
+    }
+    entRemove(bombPickups, hit);
+    entDirty = true;
+}
+
+void gameType::update(double dt, const inputType & in) {
+    const bool upDown = in.up, leftDown = in.left, rightDown = in.right, bombPressed = in.bomb;
+
+    time += dt;
+
+    drawSpr(LEVEL_BG[curLevel-1], 0, 0);
+
+    lastEngineT -= lastEngineT * dt * 8.f;
+
+    const float prevX = playerX, prevY = playerY, prevVX = playerVX, prevVY = playerVY;
+    if (!playerDead && !restarting) {
+        if (shipIntegrate(playerX, playerY, playerVX, playerVY, playerAngle, playerFuel, in, dt)) {
+            lastEngineT = 1.f;
+        }
+    }
+
+    int camX = (int)round(playerX),
+        camY = (int)round(playerY);
+
+    camX += ((rngInt(rngFx) & 0xFF) * (int)(flashT * 200.f) - 100) / (255 * 20);
+    camY += ((rngInt(rngFx) & 0xFF) * (int)(flashT * 200.f) - 100) / (255 * 20);
+
+    camX = CLAMP(camX, 32, 512 - 32);
+    camY = CLAMP(camY, 32, 512 - 32);
+
+    for (int i=0; i<(int)spouts.size(); i++) {
+        drawSpr(SPOUT_SPR, (int)spouts[i].x - camX - 8 + 32, (int)spouts[i].y - camY - 8 + 32);
+        addWater(spouts[i].x, spouts[i].y, 0., 4.f, quality.spout);
+    }
+
+    if (!playerDead) {
+        wakeParticles((int)round(playerX) - 8, (int)round(playerY) - 8, (int)round(playerX) + 7, (int)round(playerY) + 7);
+    }
+    // spouts, pools & particles step at BASE_HZ whatever the tick rate, the fluid's too stiff
+    // to settle in longer steps
+    const int steps = baseTicks(dt);
+    for (int k=0; k<steps; k++) {
+        for (int i=0; k>0 && i<(int)spouts.size(); i++) {
+            addWater(spouts[i].x, spouts[i].y, 0., 4.f, quality.spout);
+        }
+        updateRenderWater(camX, camY, k == steps - 1);
+        prtHashBuild();
+        if (k == 0 && !playerDead && !restarting) {
+            shipWater(dt); // before the particles move, so the hull finds them where phash has them
+        }
+        updateRenderParticles(dt / steps, camX, camY, k == steps - 1);
+    }
+
+    terrainRender(camX, camY);
+    updateRenderChunks(dt, camX, camY);
+
+    for (int i=0; i<(int)depots.size(); i++) {
+        drawSpr(DEPOT_FRAMES[CLAMP((int)(floor(depots[i].fuel * 5.f)), 0, 4)], -2 + (int)depots[i].x - camX + 32, (int)depots[i].y - camY + 32 - 2);
+    }
+
+    for (int i=0; i<(int)bombPickups.size(); i++) {
+        if (bombPickups[i].available) {
+            drawSpr(BOMB_PICKUP_FRAMES[(int)(time * 1.5f) & 1], -2 + (int)bombPickups[i].x - camX + 32, (int)bombPickups[i].y - camY + 32 + 1);
+        }
+        else {
+            drawSpr(BOMB_PICKED_UP, -2 + (int)bombPickups[i].x - camX + 32, (int)bombPickups[i].y - camY + 32 + 1);
+        }
+    }
+
+    if (flagVis) {
+        drawSpr(FLAG_FRAMES[CLAMP((int)(floor(flagH * 8.f)), 0, 3)], -2 + (int)flagX - camX + 32, (int)flagY - camY + 32 - 3);
+    }
+
+    if (!playerDead) {
+        bool landed = false;
+        bool landingClose = (int)(floor(playerAngle)) == 0 && sprCollideTerrain(SHIP_OFF[0], (int)round(playerX) - 8, (int)round(playerY) - 8 + 3) && !upDown;
+        if (landingClose != wasGearDown) {
+            playSound(SFX_LAND, 2.0, 0.5);
+        }
+        wasGearDown = landingClose;
+        bool justDied = false;
+        vector<int> near;
+
+        // only the first bomb to hit rock goes off in a tick
+        int bombExI = -1;
+        if (!beatLevel) {
+            for (int i=0; i<(int)bombs.size(); i++) {
+                bombType & b = bombs[i];
+                b.ox = b.x;
+                b.oy = b.y;
+                b.t += dt;
+                b.xv -= b.xv * dt * 0.25f;
+                b.yv -= b.yv * dt * 0.25f;
+                b.yv += dt * GRAVITY;
+                b.x += b.xv * dt;
+                b.y += b.yv * dt;
+            }
+            for (int i=0; i<(int)bombs.size(); i++) {
+                drawSpr(BOMB_FRAMES[(int)(time * 3.f) & 1], (int)round(bombs[i].x)-1 - camX + 32, (int)round(bombs[i].y)-2 - camY + 32);
+            }
+            for (int i=0; i<(int)bombs.size() && bombExI < 0; i++) {
+                bombType & b = bombs[i];
+                float toi, nx, ny;
+                if (sprSweepTerrain(BOMB_FRAMES[0], b.ox, b.oy, b.x, b.y, -1, -2, toi, nx, ny)) {
+                    b.x = sweepLerp(b.ox, b.x, toi);
+                    b.y = sweepLerp(b.oy, b.y, toi);
+                    bombExI = i;
+                }
+            }
+        }
+
+        if (bombExI >= 0) {
+            const bombType b = bombs[bombExI];
+            bombs.erase(bombs.begin() + bombExI); // kept in drop order, the oldest goes off first
+            explosion(b.x, b.y, b.xv, b.yv, 256);
+            playSound(SFX_BOMB);
+            flashT += 1.f;
+            terrainAdd(EX_HUGE, (int)b.x, (int)b.y, 0, -400);
+            if (sqrt((playerX-b.x)*(playerX-b.x)+(playerY-b.y)*(playerY-b.y)) < 10.f) {
+                justDied = true;
+            }
+            blastObjects(b.x, b.y, 10.f, 1.f);
+            if (sqrt((b.x-flagX)*(b.x-flagX)+(b.y-flagY)*(b.y-flagY)) < 7.f) {
+                justDied = true;
+                flagVis = false;
+            }
+        }
+
+        if (bombPressed && playerBombs > 0) {
+            bombType b;
+            b.t = 0.f;
+            b.xv = playerVX * 1.0f;
+            b.yv = playerVY * 2.f;
+            b.x = b.ox = playerX;
+            b.y = b.oy = playerY;
+            bombs.push_back(b);
+            playerBombs -= 1;
+            playSound(SFX_USE_BOMB);
+        }
+
+        if (waterLogged > 0.75f && playerFuel <= 0.f) {
+            justDied = true;
+        }
+
+        // swept from where the ship was, landings are judged on the speed it touched down at
+        float toi, nx, ny;
+        if ((int)(floor(playerAngle)) == 0 && !upDown && sprSweepTerrain(SHIP_OFF[0], prevX, prevY, playerX, playerY, -8, -8 + 2, toi, nx, ny)) {
+            playerX = sweepLerp(prevX, playerX, toi);
+            playerY = sweepLerp(prevY, playerY, toi);
+            if (fabs(sweepLerp(prevVY, playerVY, toi)) > 9.f || fabs(sweepLerp(prevVX, playerVX, toi)) > 13.f) {
+                justDied = true;
+                beatLevel = false;
+            }
+            else {
+                landed = true;
+                if (!wasLanded && landed) {
+                    playSound(SFX_LAND);
+                    entNear(ENT_DEPOT, playerX, playerY, 7.f, near);
+                    if (!near.empty()) {
+                        playSound(SFX_FUEL, 0.5, 0.5);
+                    }
+                    if (sqrt((playerX-flagX)*(playerX-flagX)+(playerY-flagY)*(playerY-flagY)) < 7.f) {
+                        playSound(SFX_FUEL, 0.75);
+                    }
+                }
+                wasLanded = landed;
+            }
+            playerVX = 0.f;
+            playerVY = 0.f;
+            playerX = round(playerX);
+            playerY = round(playerY);
+        }
+        else {
+            wasLanded = false;
+        }
+        if (playerX < -5.f || playerY < -5.f || playerX > 516.f || playerY > 516.f) {
+            if (!beatLevel) {
+                justDied = true;
+            }
+        }
+        if (sprSweepTerrain(SHIP_OFF[(int)(floor(playerAngle))], landed ? playerX : prevX, landed ? playerY : prevY, playerX, playerY, -8, -8, toi, nx, ny)) {
+            if (!beatLevel) {
+                justDied = true;
+                playerX = sweepLerp(prevX, playerX, toi);
+                playerY = sweepLerp(prevY, playerY, toi);
+            }
+        }
+
+        if (upDown && playerFuel > 0.f && !restarting && flagH < 0.5f) {
+            drawSpr(SHIP_ON[(int)(floor(playerAngle))], (int)round(playerX) - camX + 32-8, (int)round(playerY) - camY + 32-8);
+            float angle = (floorf(playerAngle) / 8.f) * PI * 2.f + PI * 0.5f;
+            addFire(playerX + cos(angle) * 3.5f, playerY + sin(angle) * 3.5f, cos(angle) * 20.f, sin(angle) * 20.f);
+        }
+        else {
+            if (landed || landingClose) {
+                drawSpr(SHIP_LANDED, (int)round(playerX) - camX + 32-8, (int)round(playerY) - camY + 32-8);
+            }
+            else {
+                drawSpr(SHIP_OFF[(int)(floor(playerAngle))], (int)round(playerX) - camX + 32-8, (int)round(playerY) - camY + 32-8);
+            }
+        }
+
+        if (justDied && !restarting) {
+            playSound(SFX_DIE);
+            explosion(playerX, playerY, playerVX, playerVY, 256);
+            flashT += 1.f;
+            terrainAdd(EX_BIG, (int)playerX, (int)playerY, 0, -400);
+            playerDead = true;
+            playerBombs = 0;
+            playerFuel = 0.f;
+            blastObjects(playerX, playerY, 9.f, 0.5f);
+            if (sqrt((playerX-flagX)*(playerX-flagX)+(playerY-flagY)*(playerY-flagY)) < 11.f) {
+                flagVis = false;
+            }
+        }
+        else if (landed && sqrt((playerX-flagX)*(playerX-flagX)+(playerY-flagY)*(playerY-flagY)) < 7.f) {
+            flagH += dt * 0.5f;
+            beatLevel = true;
+        }
+        else {
+            flagH -= dt * 0.5f;
+            if (flagH < 0.f) {
+                flagH = 0.f;
+            }
+        }
+
+        if (landed) {
+            entNear(ENT_DEPOT, playerX, playerY, 7.f, near);
+            for (int k=0; k<(int)near.size(); k++) {
+                depotType & d = depots[near[k]];
+                float take = MIN(d.fuel, MIN(dt / 3.f, 1.f - playerFuel));
+                if (take > 0.f) {
+                    d.fuel -= take;
+                    playerFuel += take;
+                    if (playerFuel > 1.f) {
+                        playerFuel = 1.f;
+                    }
+                }
+            }
+        }
+
+        entNear(ENT_PICKUP, playerX, playerY, 3.f, near);
+        for (int k=0; k<(int)near.size(); k++) {
+            if (bombPickups[near[k]].available) {
+                playSound(SFX_GET_BOMB);
+                playerBombs += 1;
+                bombPickups[near[k]].available = false;
+            }
+        }
+    }
+
+    if (flashT > 0.01f) {
+        flashT -= flashT * dt * 2.f;
+        drawBox(0, 0, 64, 64, 0xFFFFFF | (CLAMP((uint32_t)(flashT * 255.f), 0, 255) << 24u));
+    }
+    else {
+        flashT = 0.f;
+        if (playerDead) {
+            restarting = true;
+        }
+    }
+
+    if (waterLogged > 0.75f && !playerDead) {
+        playerFuel -= waterLogged * 2.0f * dt;
+        if (playerFuel < 0.f) {
+            playerFuel = 0.f;
+        }
+    }
+
+    drawSpr(FUEL_BAR_BG, 0, 0);
+    drawSpr(SPR_X(FUEL_BAR), SPR_Y(FUEL_BAR), CLAMP(SPR_W(FUEL_BAR) * (int)(255.f * playerFuel) / 255, 0, SPR_W(FUEL_BAR)), SPR_H(FUEL_BAR), 3, 3);
+
+    if (!playerDead) {
+        waterLogged += waterPercentInRadius(playerX, playerY, 3.f) * dt * 2.f;
+        if (waterLogged > 1.f) {
+            waterLogged = 1.f;
+        }
+    }
+
+    if (waterLogged > 0.f || curLevel >= 4) {
+        drawSpr(WATER_BAR_BG, 0, 55);
+        drawSpr(SPR_X(WATER_BAR), SPR_Y(WATER_BAR), CLAMP(SPR_W(WATER_BAR) * (int)(255.f * waterLogged) / 255, 0, SPR_W(WATER_BAR)), SPR_H(WATER_BAR), 3, 55 + 3);
+        if (!playerDead) {
+            waterLogged -= dt * 1.f;
+            if (waterLogged < 0.f) {
+                waterLogged = 0.f;
+            }
+        }
+    }
+
+    for (int i=0; i<playerBombs; i++) {
+        drawSpr(BOMB_HUD_FRAMES[(int)(time) & 1], 2 + i * 5, 9);
+    }
+}
+
+/* ENV */
+struct lunarEnvsType {
+    int k;
+    gameType * games;
+    gameType * templates[N_LEVELS]; // freshly initialised levels, resets copy these instead of rebuilding
+    int * levels;
+    bool * done;
+
+    const uint8_t * actions;
+    uint8_t * frames;
+    lunarObsType * obs;
+
+    vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake, finished;
+    int generation, pending;
+    bool quit;
+};
+
+static void lunarEnvStepRange(lunarEnvsType * envs, int from, int to) {
+    static thread_local uint8_t scratch[LUNAR_FRAME_BYTES];
+    uint8_t * oldBfr = bfr64;
+    for (int i=from; i<to; i++) {
+        gameType & g = envs->games[i];
+        if (envs->done[i]) {
+            g.copyFrom(*envs->templates[envs->levels[i]-1]);
+            envs->done[i] = false;
+        }
+        bfr64 = envs->frames ? envs->frames + i * LUNAR_FRAME_BYTES : scratch;
+        clearBfr();
+        uint8_t act = envs->actions ? envs->actions[i] : 0;
+        inputType in;
+        in.up = (act & LUNAR_ACT_THRUST) != 0;
+        in.left = (act & LUNAR_ACT_LEFT) != 0;
+        in.right = (act & LUNAR_ACT_RIGHT) != 0;
+        in.bomb = (act & LUNAR_ACT_BOMB) != 0;
+        g.update(1. / 60., in);
+        bool won = g.flagH > 1.f;
+        envs->done[i] = g.playerDead || won;
+        if (envs->obs) {
+            lunarObsType & o = envs->obs[i];
+            o.x = g.playerX;
+            o.y = g.playerY;
+            o.vx = g.playerVX;
+            o.vy = g.playerVY;
+            o.angle = g.playerAngle;
+            o.fuel = g.playerFuel;
+            o.water = g.waterLogged;
+            o.bombs = g.playerBombs;
+            o.landed = g.wasLanded;
+            o.dead = g.playerDead;
+            o.won = won;
+            o.done = envs->done[i];
+        }
+    }
+    bfr64 = oldBfr;
+}
+
+// slice w of n covers envs [k*w/n, k*(w+1)/n), the calling thread always takes slice 0
+static void lunarEnvWorker(lunarEnvsType * envs, int w) {
+    const int n = (int)envs->workers.size() + 1;
+    int seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> l(envs->lock);
+            envs->wake.wait(l, [&]{ return envs->quit || envs->generation != seen; });
+            if (envs->quit) {
+                return;
+            }
+            seen = envs->generation;
+        }
+        lunarEnvStepRange(envs, envs->k * w / n, envs->k * (w + 1) / n);
+        std::lock_guard<std::mutex> l(envs->lock);
+        if (--envs->pending == 0) {
+            envs->finished.notify_one();
+        }
+    }
+}
+
+int lunarEnvInit(const char * spriteSheet) {
+    if (sprBfr == NULL && !loadPack(PACK_FILE) && !loadSprites(spriteSheet)) {
+        cerr << "Error loading: " << spriteSheet << endl;
+        return 0;
+    }
+    return 1;
+}
+
+lunarEnvsType * lunarEnvCreate(int k, const int * levels, int threads) {
+    if (sprBfr == NULL || k <= 0) {
+        return NULL;
+    }
+    lunarEnvsType * envs = new lunarEnvsType();
+    envs->k = k;
+    envs->games = new gameType[k];
+    envs->levels = new int[k];
+    envs->done = new bool[k];
+    memset(envs->templates, 0, sizeof(envs->templates));
+    for (int i=0; i<k; i++) {
+        envs->levels[i] = CLAMP(levels ? levels[i] : 1, 1, N_LEVELS);
+        gameType *& t = envs->templates[envs->levels[i]-1];
+        if (t == NULL) {
+            t = new gameType();
+            t->alloc();
+            t->silent = true;
+            t->initLevel(envs->levels[i]);
+        }
+        envs->games[i].alloc();
+        envs->games[i].copyFrom(*t);
+        envs->done[i] = false;
+    }
+    envs->generation = 0;
+    envs->pending = 0;
+    envs->quit = false;
+    if (threads <= 0) {
+        threads = MAX(1, (int)std::thread::hardware_concurrency());
+    }
+    threads = MIN(threads, k);
+    envs->workers.resize(threads - 1); // sized before starting, workers derive their slice from it
+    for (int w=1; w<threads; w++) {
+        envs->workers[w-1] = std::thread(lunarEnvWorker, envs, w);
+    }
+    return envs;
+}
+
+void lunarEnvDestroy(lunarEnvsType * envs) {
+    if (envs == NULL) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> l(envs->lock);
+        envs->quit = true;
+    }
+    envs->wake.notify_all();
+    for (size_t w=0; w<envs->workers.size(); w++) {
+        envs->workers[w].join();
+    }
+    for (int i=0; i<envs->k; i++) {
+        envs->games[i].release();
+    }
+    for (int i=0; i<N_LEVELS; i++) {
+        if (envs->templates[i]) {
+            envs->templates[i]->release();
+            delete envs->templates[i];
+        }
+    }
+    delete[] envs->games;
+    delete[] envs->levels;
+    delete[] envs->done;
+    delete envs;
+}
+
+void lunarEnvReset(lunarEnvsType * envs, int i) {
+    if (envs && i >= 0 && i < envs->k) {
+        envs->games[i].copyFrom(*envs->templates[envs->levels[i]-1]);
+        envs->done[i] = false;
+    }
+}
+
+void lunarEnvStep(lunarEnvsType * envs, const uint8_t * actions, uint8_t * frames, lunarObsType * obs) {
+    envs->actions = actions;
+    envs->frames = frames;
+    envs->obs = obs;
+    const int n = (int)envs->workers.size() + 1;
+    if (n > 1) {
+        std::lock_guard<std::mutex> l(envs->lock);
+        envs->pending = n - 1;
+        envs->generation += 1;
+    }
+    envs->wake.notify_all();
+    lunarEnvStepRange(envs, 0, envs->k / n);
+    if (n > 1) {
+        std::unique_lock<std::mutex> l(envs->lock);
+        envs->finished.wait(l, [&]{ return envs->pending == 0; });
+    }
+}
+
+// --env-bench: random-action throughput of the headless step
+int envBench(int k, int threads, int level, int steps) {
+    if (!lunarEnvInit("sprites/sprite-sheet.png")) {
+        return 1;
+    }
+    vector<int> levels(k, level);
+    lunarEnvsType * envs = lunarEnvCreate(k, levels.data(), threads);
+    vector<uint8_t> actions(k), frames(k * LUNAR_FRAME_BYTES);
+    vector<lunarObsType> obs(k);
+    rngType rng;
+    rngSeed(rng, 1234);
+    Clock clock;
+    for (int s=0; s<steps; s++) {
+        for (int i=0; i<k; i++) {
+            actions[i] = (uint8_t)(rngInt(rng) & (LUNAR_ACT_THRUST | LUNAR_ACT_LEFT | LUNAR_ACT_RIGHT));
+        }
+        lunarEnvStep(envs, actions.data(), frames.data(), obs.data());
+    }
+    double secs = clock.getElapsedTime().asSeconds();
+    cout << k << " envs, " << (envs->workers.size() + 1) << " threads, level " << level << ": "
+         << (long)((double)k * steps / secs) << " env-steps/s" << endl;
+    lunarEnvDestroy(envs);
+    return 0;
+}
+/* --- */
+
+/* AUTOPILOT */
+// Plans inputs that raise the flag. The search never clones a gameType: it steps
+// pilotNodeType, a few hundred bytes of ship/bomb/depot state, over a read-only bitmap of
+// the terrain, with craters kept as a short list. The ship physics are shipIntegrate and
+// the bomb/landing/crash/refuel/pickup rules mirror gameType::update in the same order.
+// Water is forecast by running a copy of the game ahead, plans are run through the real
+// simulation and replanned from wherever it disagrees. Depots to fill up at and bomb pickups
+// are picked up front as a route of stops, the search then flies it one stop at a time.
+
+const int PILOT_TICKS = 6;          // ticks each planned input is held for
+const int PILOT_REPLAN_TICKS = 120;  // ticks flown before replanning on levels with water
+const int PILOT_WATER_AHEAD = 20;    // s of water flow looked ahead
+const float PILOT_WATER_COST = 8.f; // extra per px through solid water
+const int PILOT_MAX_CARVE = 16;
+const int PILOT_MAX_DEPOT = 16;     // nodes are copied a lot, so they only track this many of each
+const int PILOT_MAX_PICKUP = 8;     // fits pilotNodeType::pickups
+const int PILOT_MAX_BOMBS = 8;
+const int PILOT_MAX_ROUTE = 6;      // stops on a route, the flag included
+const int PILOT_ROUTES = 3;         // routes --solve falls back on
+const int PILOT_STOPS = 1 + PILOT_MAX_DEPOT + PILOT_MAX_PICKUP; // the flag, then each depot, then each pickup
+const int PILOT_PAD = 32;           // empty bitmap margin left & right of the playfield
+const int PILOT_STRIDE = 9;         // 64 bit words per bitmap row
+const int PILOT_GRID = 256;         // distance fields are at 2 px
+const float PILOT_INF = 1e9f;
+const float PILOT_ROCK_COST = 8.f;  // per px of rock a bomb has to open up
+const float PILOT_BLAST_DEPTH = 6.f; // px into rock an EX_HUGE crater clears, either side of a wall
+const float PILOT_STOP_PX = 50.f;   // credited for each route stop made, the last px to one are worth it
+const float PILOT_BOMB_PX = 40.f;   // credited for each bomb not yet gone off, so one isn't let go of for nothing
+
+// the scoring is a heuristic and no one setting flies every level, --solve tries each of these
+struct pilotTuneType {
+    float look;       // s of ballistic flight credited ahead of the ship
+    float pxPerTank;  // rough px flown on a full tank, to plan where to refuel
+};
+
+const pilotTuneType PILOT_TUNES[] = {
+    { 2.f, 700.f },
+    { 1.5f, 500.f },
+    { 3.f, 1000.f }
+};
+
+struct pilotBombType {
+    bool exists;
+    float x, y, xv, yv;
+    float hitX, hitY; // where it's going to go off, PILOT_INF if it isn't, see pilotAim
+};
+
+struct pilotCarveType {
+    int16_t x, y;
+    bool huge; // EX_HUGE, else EX_BIG
+};
+
+struct pilotNodeType {
+    float x, y, vx, vy, angle, fuel, flagH, water;
+    float fuelUsed;
+    float depotFuel[PILOT_MAX_DEPOT]; // < 0 once blown up
+    pilotBombType bombs[PILOT_MAX_BOMBS];
+    pilotCarveType carves[PILOT_MAX_CARVE];
+    int nCarve, playerBombs;
+    uint8_t pickups;              // bit i set while bombPickups[i] can be collected
+    uint8_t stage;                // route stop it's headed for
+    bool dead, beat;
+    float score;
+    int parent, ticks;            // beam slot of the parent, ticks spent on act
+    uint8_t act;                  // LUNAR_ACT_* bits
+};
+
+struct pilotTrailType {
+    int parent;
+    uint8_t act, ticks, stage;
+};
+
+struct pilotStopType {
+    float x, y, r;                       // reached within r px
+    int depot, pickup;                   // which one it is, -1 if not
+    vector<float> fieldFree, fieldRock;  // geodesic px to here, without / with blasting through rock
+    vector<int> gate;                    // cell of the first rock the fieldRock way blasts through, -1 if none
+};
+
+struct pilotType {
+    uint64_t solid[512 * PILOT_STRIDE];
+    uint16_t shipMask[8][16], bombMask[3];
+    uint32_t hugeMask[32], bigMask[16];
+    int nDepots, nPickups;
+    float depotX[PILOT_MAX_DEPOT], depotY[PILOT_MAX_DEPOT];
+    float pickupX[PILOT_MAX_PICKUP], pickupY[PILOT_MAX_PICKUP];
+    float flagX, flagY;
+    pilotStopType stops[PILOT_STOPS];
+    int route[PILOT_MAX_ROUTE], nRoute;  // stops still to make, the flag last
+    float rest[PILOT_MAX_ROUTE];         // px of the route left once each stop is made
+    float glide[PILOT_MAX_ROUTE];        // px on from each stop to where the ship next has to set down
+    float dry[PILOT_MAX_ROUTE];          // px on from each stop to the next depot or the flag
+    vector<float> fieldWall;             // px to the nearest cell the ship doesn't fit in
+    vector<float> water;                 // waterPercentInRadius at each 2 px cell, frozen at plan time
+    bool waterDecays;                    // the water bar drains every frame from level 4 on
+    pilotTuneType tune;
+    float fuelWeight;                    // px of distance a full tank of fuel is worth
+    long ticksRun;
+};
+
+struct pilotResultType {
+    bool solved;
+    vector<uint8_t> inputs;   // one LUNAR_ACT_* byte per tick
+    float fuelUsed, fuelLeft;
+    int replans;
+    long ticksRun;            // planner ticks, for throughput
+};
+
+static void pilotMask(uint64_t spr, uint32_t minAlpha, uint32_t * rows) {
+    for (int y=0; y<SPR_H(spr); y++) {
+        rows[y] = 0;
+        for (int x=0; x<SPR_W(spr); x++) {
+            if (((sprBfr[SPR_X(spr) + x + ((SPR_Y(spr) + y) << 10)] >> 24) & 0xFF) > minAlpha) {
+                rows[y] |= 1u << x;
+            }
+        }
+    }
+}
+
+// 8-neighbour dijkstra at 2 px from the seeded cells, entering a cell costs its cost per px
+// (PILOT_INF where it can't be entered)
+// geodesic px from the seed cells. With gate given, it also keeps the first of the hard cells
+// the way from each cell runs into, -1 if it runs through none
+static void pilotField(vector<float> & f, const vector<uint8_t> & seed, const vector<float> & cost, vector<int> * gate = NULL, const vector<uint8_t> * hard = NULL) {
+    f.assign(PILOT_GRID * PILOT_GRID, PILOT_INF);
+    if (gate) {
+        gate->assign(PILOT_GRID * PILOT_GRID, -1);
+    }
+    std::priority_queue<std::pair<float, int>, vector<std::pair<float, int>>, std::greater<std::pair<float, int>>> q;
+    for (int i=0; i<PILOT_GRID * PILOT_GRID; i++) {
+        if (seed[i]) {
+            f[i] = 0.f;
+            q.push(std::make_pair(0.f, i));
+        }
+    }
+    while (!q.empty()) {
+        float d = q.top().first;
+        int i = q.top().second;
+        q.pop();
+        if (d > f[i]) {
+            continue;
+        }
+        int x = i & 255, y = i >> 8;
+        for (int oy=-1; oy<=1; oy++) {
+            for (int ox=-1; ox<=1; ox++) {
+                int nx = x + ox, ny = y + oy;
+                if ((ox == 0 && oy == 0) || nx < 0 || ny < 0 || nx >= PILOT_GRID || ny >= PILOT_GRID) {
+                    continue;
+                }
+                int j = nx + (ny << 8);
+                if (cost[j] >= PILOT_INF) {
+                    continue;
+                }
+                float step = ((ox && oy) ? 2.828f : 2.f) * cost[j];
+                if (d + step < f[j]) {
+                    f[j] = d + step;
+                    q.push(std::make_pair(d + step, j));
+                    if (gate) {
+                        (*gate)[j] = (*hard)[j] ? j : (*gate)[i];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// seeded within r px of sx, sy
+static void pilotField(vector<float> & f, const vector<float> & cost, float sx, float sy, float r, vector<int> * gate = NULL, const vector<uint8_t> * hard = NULL) {
+    vector<uint8_t> seed(PILOT_GRID * PILOT_GRID);
+    for (int i=0; i<PILOT_GRID * PILOT_GRID; i++) {
+        float dx = (float)((i & 255) * 2 + 1) - sx,
+              dy = (float)((i >> 8) * 2 + 1) - sy;
+        seed[i] = dx*dx + dy*dy < r*r;
+    }
+    pilotField(f, seed, cost, gate, hard);
+}
+
+// what waterPercentInRadius(.., 3) would read for one more drop at ox, oy
+static void pilotSplat(vector<float> & now, float ox, float oy) {
+    int gx = (int)ox >> 1, gy = (int)oy >> 1;
+    for (int y=MAX(gy-2, 0); y<=MIN(gy+2, PILOT_GRID-1); y++) {
+        for (int x=MAX(gx-2, 0); x<=MIN(gx+2, PILOT_GRID-1); x++) {
+            float dx = (float)(x * 2 + 1) - ox, dy = (float)(y * 2 + 1) - oy;
+            if (dx*dx + dy*dy < 9.f) {
+                now[x + (y << 8)] += 1.f / (PI * 9.f);
+            }
+        }
+    }
+}
+
+// water keeps coming out of the spouts, so the plan steers clear of everywhere it's going to be
+// over the next PILOT_WATER_AHEAD seconds: a copy of the game is run forward without the ship
+static void pilotWater(pilotType & p, const gameType & g, gameType * ahead) {
+    p.water.assign(PILOT_GRID * PILOT_GRID, 0.f);
+    p.waterDecays = g.curLevel >= 4;
+    if (ahead) {
+        ahead->copyFrom(g);
+        ahead->silent = true;
+        ahead->playerDead = true;
+    }
+    const gameType & w = ahead ? *ahead : g;
+    vector<float> now(PILOT_GRID * PILOT_GRID);
+    inputType none = { false, false, false, false };
+    for (int s=0; s<=(ahead ? PILOT_WATER_AHEAD : 0); s++) {
+        for (int t=0; s>0 && t<60; t++) {
+            ahead->update(1. / 60., none);
+        }
+        std::fill(now.begin(), now.end(), 0.f);
+        for (int i=0; i<w.prtTop; i++) {
+            const prtType & o = w.plist[i];
+            if (o.life > 1.f && o.pal == PAL_BLUE) {
+                pilotSplat(now, o.x, o.y);
+            }
+        }
+        for (int i=0; w.waterCells>0 && i<512*512; i++) {
+            if (w.waterBfr[i] > 1) { // pooled px count like a particle at their centre
+                pilotSplat(now, (float)(i & 511) + 0.5f, (float)(i >> 9) + 0.5f);
+            }
+        }
+        for (int i=0; i<PILOT_GRID * PILOT_GRID; i++) {
+            p.water[i] = MAX(p.water[i], MIN(now[i], 1.f));
+        }
+#ifdef PILOT_TRACE
+        if (getenv("PWET")) fprintf(stderr, "wet s %d at flag %.2f %.2f %.2f\n", s, now[102 + (72 << 8)], now[100 + (70 << 8)], now[98 + (72 << 8)]);
+#endif
+    }
+}
+
+static float pilotAt(const vector<float> & f, float x, float y);
+static void pilotRest(pilotType & p);
+
+// route is the stops still to make, their fields are all that's worked out; with none every
+// stop gets its fields for pilotRoute to pick from. false if the level has more depots, pickups
+// or bombs in flight than a node can track
+bool pilotInit(pilotType & p, const gameType & g, gameType * ahead, const pilotTuneType & tune, float fuelWeight, const vector<int> & route) {
+    if ((int)g.depots.size() > PILOT_MAX_DEPOT || (int)g.bombPickups.size() > PILOT_MAX_PICKUP || (int)g.bombs.size() > PILOT_MAX_BOMBS) {
+        cerr << "autopilot: level " << g.curLevel << " has " << g.depots.size() << " depots, " << g.bombPickups.size()
+             << " bomb pickups and " << g.bombs.size() << " bombs in flight, it can only plan with up to "
+             << PILOT_MAX_DEPOT << ", " << PILOT_MAX_PICKUP << " and " << PILOT_MAX_BOMBS << endl;
+        return false;
+    }
+    memset(p.solid, 0, sizeof(p.solid));
+    vector<int> sat(513 * 513, 0); // summed area of solid px, for the clearance test below
+    for (int y=0; y<512; y++) {
+        const uint16_t * it = g.terrainBfr + (y << 10);
+        for (int x=0; x<512; x++) {
+            int s = it[x] > 0 ? 1 : 0;
+            if (s) {
+                p.solid[y * PILOT_STRIDE + ((x + PILOT_PAD) >> 6)] |= 1ull << ((x + PILOT_PAD) & 63);
+            }
+            sat[(x+1) + (y+1) * 513] = s + sat[x + (y+1) * 513] + sat[(x+1) + y * 513] - sat[x + y * 513];
+        }
+    }
+    uint32_t rows[32];
+    for (int a=0; a<8; a++) {
+        pilotMask(SHIP_OFF[a], 0, rows);
+        for (int y=0; y<16; y++) {
+            p.shipMask[a][y] = (uint16_t)rows[y];
+        }
+    }
+    pilotMask(BOMB_FRAMES[0], 0, rows);
+    for (int y=0; y<3; y++) {
+        p.bombMask[y] = (uint16_t)rows[y];
+    }
+    pilotMask(EX_HUGE, 16, p.hugeMask);
+    pilotMask(EX_BIG, 16, p.bigMask);
+
+    p.nDepots = (int)g.depots.size();
+    for (int i=0; i<p.nDepots; i++) {
+        p.depotX[i] = g.depots[i].x;
+        p.depotY[i] = g.depots[i].y;
+    }
+    p.nPickups = 0;
+    for (int i=0; i<(int)g.bombPickups.size(); i++) {
+        if (g.bombPickups[i].available) {
+            p.nPickups = i + 1;
+        }
+        p.pickupX[i] = g.bombPickups[i].x;
+        p.pickupY[i] = g.bombPickups[i].y;
+    }
+    p.flagX = g.flagX;
+    p.flagY = g.flagY;
+    for (int i=0; i<PILOT_STOPS; i++) {
+        pilotStopType & s = p.stops[i];
+        s.depot = i >= 1 && i < 1 + PILOT_MAX_DEPOT ? i - 1 : -1;
+        s.pickup = i >= 1 + PILOT_MAX_DEPOT ? i - 1 - PILOT_MAX_DEPOT : -1;
+        s.x = i == 0 ? p.flagX : s.depot >= 0 ? p.depotX[s.depot] : p.pickupX[s.pickup];
+        s.y = i == 0 ? p.flagY : s.depot >= 0 ? p.depotY[s.depot] : p.pickupY[s.pickup];
+        s.r = s.pickup >= 0 ? 3.f : 6.f;
+        s.fieldFree.clear();
+        s.fieldRock.clear();
+        s.gate.clear();
+    }
+    p.nRoute = (int)route.size();
+    for (int i=0; i<p.nRoute; i++) {
+        p.route[i] = route[i];
+    }
+    p.tune = tune;
+    p.fuelWeight = fuelWeight;
+    p.ticksRun = 0;
+
+    // a cell is open if no rock is within 3 px of it, roughly the ship at any angle
+    vector<uint8_t> open(PILOT_GRID * PILOT_GRID);
+    for (int i=0; i<PILOT_GRID * PILOT_GRID; i++) {
+        int x1 = CLAMP((i & 255) * 2 - 3, 0, 512), x2 = CLAMP((i & 255) * 2 + 5, 0, 512),
+            y1 = CLAMP((i >> 8) * 2 - 3, 0, 512), y2 = CLAMP((i >> 8) * 2 + 5, 0, 512);
+        open[i] = (sat[x2 + y2 * 513] - sat[x1 + y2 * 513] - sat[x2 + y1 * 513] + sat[x1 + y1 * 513]) == 0;
+    }
+    pilotWater(p, g, ahead);
+    vector<uint8_t> shut(open.size());
+    for (int i=0; i<PILOT_GRID * PILOT_GRID; i++) {
+        int x = i & 255, y = i >> 8;
+        shut[i] = !open[i] || x == 0 || y == 0 || x == PILOT_GRID-1 || y == PILOT_GRID-1;
+    }
+    pilotField(p.fieldWall, shut, vector<float>(open.size(), 1.f));
+    // a leg only blasts through rock that's thin enough for one crater, anything further into it
+    // than PILOT_BLAST_DEPTH it has to go round. Depth is from the nearest rock-free cell, so a
+    // shaft too narrow to fly down counts as the rock around it and not as one thick wall
+    vector<float> deep, clear, costFree(open.size()), costRock(open.size());
+    vector<uint8_t> air(open.size()), hard(open.size());
+    for (int i=0; i<PILOT_GRID * PILOT_GRID; i++) {
+        int x1 = (i & 255) * 2, y1 = (i >> 8) * 2;
+        air[i] = (sat[x1 + 2 + (y1 + 2) * 513] - sat[x1 + (y1 + 2) * 513] - sat[x1 + 2 + y1 * 513] + sat[x1 + y1 * 513]) == 0;
+    }
+    pilotField(deep, air, vector<float>(open.size(), 1.f));
+    pilotField(clear, open, vector<float>(open.size(), 1.f));
+    for (int i=0; i<PILOT_GRID * PILOT_GRID; i++) {
+        float wet = 1.f + p.water[i] * PILOT_WATER_COST;
+        costFree[i] = open[i] ? wet : PILOT_INF;
+        costRock[i] = open[i] ? wet : deep[i] <= PILOT_BLAST_DEPTH ? wet * PILOT_ROCK_COST : PILOT_INF;
+        hard[i] = clear[i] > 4.f; // past the clearance open keeps, so it's rock or a shaft and not just close to it
+    }
+    for (int i=0; i<PILOT_STOPS; i++) {
+        pilotStopType & s = p.stops[i];
+        bool want = (s.depot < 0 || s.depot < p.nDepots) && (s.pickup < 0 || (s.pickup < p.nPickups && g.bombPickups[s.pickup].available));
+        if (want && p.nRoute > 0) {
+            want = std::find(p.route, p.route + p.nRoute, i) != p.route + p.nRoute;
+        }
+        if (want) {
+            pilotField(s.fieldFree, costFree, s.x, s.y, s.r);
+            pilotField(s.fieldRock, costRock, s.x, s.y, s.r, &s.gate, &hard);
+        }
+    }
+    if (p.nRoute > 0) {
+        pilotRest(p);
+    }
+#ifdef PILOT_TRACE
+    static bool dumped = false;
+    if (!dumped && getenv("PMAP")) { dumped = true;
+        for (int y=0; y<512; y+=4) { fprintf(stderr, "%3d ", y); for (int x=0; x<512; x+=4) { int c=0; for (int yy=0;yy<4;yy++) for(int xx=0;xx<4;xx++) c += (p.solid[(y+yy)*PILOT_STRIDE+((x+xx+PILOT_PAD)>>6)]>>((x+xx+PILOT_PAD)&63))&1; char ch = c>=8?'#':c>0?'+':'.'; for (int i=0;i<PILOT_STOPS;i++) if (p.stops[i].fieldFree.size() && (int)p.stops[i].x/4==x/4 && (int)p.stops[i].y/4==y/4) ch = i==0?'F':i<17?'D':'B'; fprintf(stderr, "%c", ch);} fprintf(stderr, "\n"); } }
+    if (!dumped && getenv("PDUMP")) { dumped = true; int X0=atoi(getenv("PDUMP")), Y0=atoi(getenv("PDUMPY"));
+        for (int y=Y0; y<Y0+24; y++) { fprintf(stderr, "%3d ", y); for (int x=X0; x<X0+48; x++) fprintf(stderr, "%c", (p.solid[y*PILOT_STRIDE+((x+PILOT_PAD)>>6)]>>((x+PILOT_PAD)&63))&1 ? '#' : (x==(int)p.stops[17].x&&y==(int)p.stops[17].y)?'B':'.'); fprintf(stderr, "\n"); } }
+#endif
+    return true;
+}
+
+static void pilotAim(const pilotType & p, const pilotNodeType & n, pilotBombType & b);
+
+// p has to have been through pilotInit with g
+void pilotRoot(const pilotType & p, pilotNodeType & n, const gameType & g) {
+    memset(&n, 0, sizeof(n));
+    n.x = g.playerX; n.y = g.playerY;
+    n.vx = g.playerVX; n.vy = g.playerVY;
+    n.angle = g.playerAngle;
+    n.fuel = g.playerFuel;
+    n.flagH = g.flagH;
+    n.water = g.waterLogged;
+    for (int i=0; i<PILOT_MAX_DEPOT; i++) {
+        n.depotFuel[i] = i < (int)g.depots.size() ? g.depots[i].fuel : -1.f;
+    }
+    for (int i=0; i<(int)g.bombs.size(); i++) {
+        n.bombs[i].exists = true;
+        n.bombs[i].x = g.bombs[i].x; n.bombs[i].y = g.bombs[i].y;
+        n.bombs[i].xv = g.bombs[i].xv; n.bombs[i].yv = g.bombs[i].yv;
+        pilotAim(p, n, n.bombs[i]);
+    }
+    for (int i=0; i<(int)g.bombPickups.size(); i++) {
+        if (g.bombPickups[i].available) {
+            n.pickups |= 1 << i;
+        }
+    }
+    n.playerBombs = g.playerBombs;
+    n.dead = g.playerDead || !g.flagVis;
+    n.beat = g.beatLevel;
+    n.parent = -1;
+}
+
+// x, y is inside a crater centred on cx, cy
+static inline bool pilotCrater(const pilotType & p, int cx, int cy, bool huge, int x, int y) {
+    int s = huge ? 32 : 16,
+        lx = x - (cx - s / 2),
+        ly = y - (cy - s / 2);
+    return lx >= 0 && ly >= 0 && lx < s && ly < s && (((huge ? p.hugeMask : p.bigMask)[ly] >> lx) & 1u);
+}
+
+static bool pilotCarved(const pilotType & p, const pilotNodeType & n, int x, int y) {
+    for (int i=0; i<n.nCarve; i++) {
+        if (pilotCrater(p, n.carves[i].x, n.carves[i].y, n.carves[i].huge, x, y)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// sprCollideTerrain for a 16 px wide mask with top left at dx, dy
+static bool pilotCollide(const pilotType & p, const pilotNodeType & n, const uint16_t * mask, int h, int dx, int dy) {
+    if (dx < -PILOT_PAD || dx > 512 + PILOT_PAD - 16) {
+        return false;
+    }
+    const int bit = dx + PILOT_PAD, w = bit >> 6, sh = bit & 63;
+    for (int y=0; y<h; y++) {
+        if (!mask[y] || (y+dy) < 0 || (y+dy) > 511) {
+            continue;
+        }
+        const uint64_t * row = p.solid + (y+dy) * PILOT_STRIDE + w;
+        uint64_t v = row[0] >> sh;
+        if (sh > 48) {
+            v |= row[1] << (64 - sh);
+        }
+        uint32_t hit = (uint32_t)v & mask[y];
+        if (hit && n.nCarve == 0) {
+            return true;
+        }
+        for (int x=0; hit; x++, hit >>= 1) {
+            if ((hit & 1u) && !pilotCarved(p, n, dx + x, dy + y)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// a node with more craters than it can keep would be planning over rock that's really gone,
+// so it isn't planned through at all
+static void pilotCarve(pilotNodeType & n, float x, float y, bool huge) {
+    if (n.nCarve == PILOT_MAX_CARVE) {
+        n.dead = true;
+        return;
+    }
+    pilotCarveType & c = n.carves[n.nCarve++];
+    c.x = (int16_t)(int)x;
+    c.y = (int16_t)(int)y;
+    c.huge = huge;
+}
+
+static inline float pilotDist(float x1, float y1, float x2, float y2) {
+    return sqrt((x1-x2)*(x1-x2)+(y1-y2)*(y1-y2));
+}
+
+// flies b on its own over n's rock to where it goes off, the way pilotStep would
+static void pilotAim(const pilotType & p, const pilotNodeType & n, pilotBombType & b) {
+    const double dt = 1. / 60.;
+    float x = b.x, y = b.y, xv = b.xv, yv = b.yv;
+    b.hitX = b.hitY = PILOT_INF;
+    for (int t=0; t<600 && y < 512.f; t++) {
+        xv -= xv * dt * 0.25f;
+        yv -= yv * dt * 0.25f;
+        yv += dt * GRAVITY;
+        x += xv * dt;
+        y += yv * dt;
+        if (pilotCollide(p, n, p.bombMask, 3, (int)round(x)-1, (int)round(y)-2)) {
+            b.hitX = x;
+            b.hitY = y;
+            return;
+        }
+    }
+}
+
+// shipWater's buoyancy & drag, with the forecast water under the ship's centre standing in for
+// the wet part of the hull. The shove from each particle isn't modelled, replanning covers it.
+static inline void pilotShipWater(const pilotType & p, pilotNodeType & n, double dt) {
+    int gx = (int)n.x >> 1, gy = (int)n.y >> 1;
+    if (n.x < 0.f || n.y < 0.f || gx >= PILOT_GRID || gy >= PILOT_GRID) {
+        return;
+    }
+    const float under = p.water[gx + (gy << 8)];
+    if (under > 0.f) {
+        n.vy -= under * GRAVITY * SHIP_BUOYANCY * dt;
+        n.vx -= n.vx * under * SHIP_WATER_DRAG * dt;
+        n.vy -= n.vy * under * SHIP_WATER_DRAG * dt;
+    }
+}
+
+// stop is still to be made on the route, a blast taking it out leaves the route unflyable
+static bool pilotAhead(const pilotType & p, const pilotNodeType & n, int stop) {
+    return std::find(p.route + n.stage, p.route + p.nRoute, stop) != p.route + p.nRoute;
+}
+
+// one tick of gameType::update, minus the drawing & particles, water as forecast
+static void pilotStep(const pilotType & p, pilotNodeType & n, uint8_t act, double dt) {
+    inputType in;
+    in.up = (act & LUNAR_ACT_THRUST) != 0;
+    in.left = (act & LUNAR_ACT_LEFT) != 0;
+    in.right = (act & LUNAR_ACT_RIGHT) != 0;
+    in.bomb = (act & LUNAR_ACT_BOMB) != 0;
+
+    float fuel = n.fuel;
+    shipIntegrate(n.x, n.y, n.vx, n.vy, n.angle, n.fuel, in, dt);
+    n.fuelUsed += fuel - n.fuel;
+    pilotShipWater(p, n, dt);
+
+    bool justDied = false;
+    int bombExI = -1;
+    for (int i=0; i<PILOT_MAX_BOMBS; i++) {
+        pilotBombType & b = n.bombs[i];
+        if (b.exists && !n.beat) {
+            b.xv -= b.xv * dt * 0.25f;
+            b.yv -= b.yv * dt * 0.25f;
+            b.yv += dt * GRAVITY;
+            b.x += b.xv * dt;
+            b.y += b.yv * dt;
+            if (bombExI < 0 && pilotCollide(p, n, p.bombMask, 3, (int)round(b.x)-1, (int)round(b.y)-2)) {
+                pilotCarve(n, b.x, b.y, true);
+                bombExI = i;
+                if (pilotDist(n.x, n.y, b.x, b.y) < 10.f) {
+                    justDied = true;
+                }
+            }
+        }
+    }
+    if (bombExI >= 0) {
+        // shift the rest down so the slots stay in drop order like gameType::bombs
+        const pilotBombType b = n.bombs[bombExI];
+        for (int i=bombExI; i<PILOT_MAX_BOMBS-1; i++) {
+            n.bombs[i] = n.bombs[i+1];
+        }
+        n.bombs[PILOT_MAX_BOMBS-1].exists = false;
+        for (int i=0; i<p.nDepots; i++) {
+            if (n.depotFuel[i] >= 0.f && pilotDist(b.x, b.y, p.depotX[i], p.depotY[i]) < 7.f) {
+                n.depotFuel[i] = -1.f;
+                pilotCarve(n, p.depotX[i], p.depotY[i], false);
+                justDied = justDied || pilotAhead(p, n, 1 + i);
+            }
+        }
+        for (int i=0; i<p.nPickups; i++) {
+            if ((n.pickups >> i) & 1 && pilotDist(b.x, b.y, p.pickupX[i], p.pickupY[i]) < 10.f) {
+                n.pickups &= ~(1 << i);
+                pilotCarve(n, p.pickupX[i], p.pickupY[i], true);
+                justDied = justDied || pilotAhead(p, n, 1 + PILOT_MAX_DEPOT + i);
+            }
+        }
+        if (pilotDist(b.x, b.y, p.flagX, p.flagY) < 7.f) {
+            justDied = true;
+        }
+    }
+
+    if (in.bomb && n.playerBombs > 0) {
+        int i = 0;
+        while (i < PILOT_MAX_BOMBS && n.bombs[i].exists) {
+            i++;
+        }
+        if (i == PILOT_MAX_BOMBS) {
+            // the game would drop it, a node can't follow so don't plan through here
+            n.dead = true;
+            return;
+        }
+        pilotBombType & b = n.bombs[i];
+        b.exists = true;
+        b.xv = n.vx * 1.0f;
+        b.yv = n.vy * 2.f;
+        b.x = n.x;
+        b.y = n.y;
+        pilotAim(p, n, b);
+        n.playerBombs -= 1;
+    }
+
+    if (n.water > 0.75f && n.fuel <= 0.f) {
+        justDied = true;
+    }
+
+    bool landed = false;
+    if ((int)(floor(n.angle)) == 0 && !in.up && pilotCollide(p, n, p.shipMask[0], 16, (int)round(n.x) - 8, (int)round(n.y) - 8 + 2)) {
+        if (fabs(n.vy) > 9.f || fabs(n.vx) > 13.f) {
+            justDied = true;
+            n.beat = false;
+        }
+        else {
+            landed = true;
+        }
+        n.vx = 0.f;
+        n.vy = 0.f;
+        n.x = round(n.x);
+        n.y = round(n.y);
+    }
+    if (n.x < -5.f || n.y < -5.f || n.x > 516.f || n.y > 516.f) {
+        if (!n.beat) {
+            justDied = true;
+        }
+    }
+    if (pilotCollide(p, n, p.shipMask[(int)(floor(n.angle))], 16, (int)round(n.x) - 8, (int)round(n.y) - 8)) {
+        if (!n.beat) {
+            justDied = true;
+        }
+    }
+
+    if (justDied) {
+        n.dead = true;
+        return;
+    }
+    else if (landed && pilotDist(n.x, n.y, p.flagX, p.flagY) < 7.f) {
+        n.flagH += dt * 0.5f;
+        n.beat = true;
+    }
+    else {
+        n.flagH -= dt * 0.5f;
+        if (n.flagH < 0.f) {
+            n.flagH = 0.f;
+        }
+    }
+
+    if (landed) {
+        for (int i=0; i<p.nDepots; i++) {
+            if (n.depotFuel[i] >= 0.f && pilotDist(n.x, n.y, p.depotX[i], p.depotY[i]) < 7.f) {
+                float take = MIN(n.depotFuel[i], MIN(dt / 3.f, 1.f - n.fuel));
+                if (take > 0.f) {
+                    n.depotFuel[i] -= take;
+                    n.fuel += take;
+                    if (n.fuel > 1.f) {
+                        n.fuel = 1.f;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int i=0; i<p.nPickups; i++) {
+        if ((n.pickups >> i) & 1 && ((n.x-p.pickupX[i])*(n.x-p.pickupX[i])+(n.y-p.pickupY[i])*(n.y-p.pickupY[i])) < 9.f) {
+            n.playerBombs += 1;
+            n.pickups &= ~(1 << i);
+        }
+    }
+
+    // on to the next stop once the tank's full at this one's depot or its bomb's collected
+    const pilotStopType & s = p.stops[p.route[n.stage]];
+    if (n.stage < p.nRoute - 1 &&
+        ((s.depot >= 0 && (n.depotFuel[s.depot] <= 0.f || (landed && n.fuel >= 0.99f && pilotDist(n.x, n.y, s.x, s.y) < 7.f))) ||
+         (s.pickup >= 0 && !((n.pickups >> s.pickup) & 1)))) {
+        n.stage += 1;
+    }
+
+    if (n.water > 0.75f) {
+        n.fuel -= n.water * 2.0f * (float)dt;
+        if (n.fuel < 0.f) {
+            n.fuel = 0.f;
+        }
+    }
+    int gx = (int)n.x >> 1, gy = (int)n.y >> 1;
+    if (n.x >= 0.f && n.y >= 0.f && gx < PILOT_GRID && gy < PILOT_GRID) {
+        n.water += p.water[gx + (gy << 8)] * (float)dt * 2.f;
+        if (n.water > 1.f) {
+            n.water = 1.f;
+        }
+    }
+    if (n.water > 0.f || p.waterDecays) {
+        n.water -= (float)dt * 1.f;
+        if (n.water < 0.f) {
+            n.water = 0.f;
+        }
+    }
+}
+
+static float pilotAt(const vector<float> & f, float x, float y) {
+    int gx = (int)x >> 1, gy = (int)y >> 1;
+    if (x < 0.f || y < 0.f || gx >= PILOT_GRID || gy >= PILOT_GRID) {
+        return PILOT_INF;
+    }
+    float v = f[gx + (gy << 8)];
+    if (v >= PILOT_INF) {
+        // the open cells keep a few px off the rock, a ship sitting on the ground is just outside them
+        for (int oy=-2; oy<=2; oy++) {
+            for (int ox=-2; ox<=2; ox++) {
+                int nx = gx + ox, ny = gy + oy;
+                if (nx >= 0 && ny >= 0 && nx < PILOT_GRID && ny < PILOT_GRID) {
+                    v = MIN(v, f[nx + (ny << 8)] + 4.f);
+                }
+            }
+        }
+    }
+    return v;
+}
+
+// first rock the way to s through it from n blasts through, as a px, false if there's none
+static bool pilotGate(const pilotStopType & s, const pilotNodeType & n, int & x, int & y) {
+    int gate = s.gate[CLAMP((int)n.x >> 1, 0, PILOT_GRID-1) + (CLAMP((int)n.y >> 1, 0, PILOT_GRID-1) << 8)];
+    x = (gate & 255) * 2 + 1;
+    y = (gate >> 8) * 2 + 1;
+    return gate >= 0;
+}
+
+// bomb b is going to open up the rock at x, y
+static inline bool pilotOpens(const pilotType & p, const pilotBombType & b, int x, int y) {
+    return b.exists && b.hitY < PILOT_INF && pilotCrater(p, (int)b.hitX, (int)b.hitY, true, x, y);
+}
+
+// px still to go to stop s: through rock while there's a bomb to blast it with, one on its way
+// to it or a crater that's opened it up already, else through open space
+static float pilotToGo(const pilotType & p, const pilotNodeType & n, const pilotStopType & s) {
+    int gx, gy;
+    bool armed = !pilotGate(s, n, gx, gy) || n.playerBombs > 0 || pilotCarved(p, n, gx, gy);
+    for (int i=0; i<PILOT_MAX_BOMBS && !armed; i++) {
+        armed = pilotOpens(p, n.bombs[i], gx, gy);
+    }
+    return MAX(pilotAt(armed ? s.fieldRock : s.fieldFree, n.x, n.y), pilotDist(n.x, n.y, s.x, s.y) - s.r);
+}
+
+// px free along the direction of travel, sphere traced through the wall field
+static float pilotRoom(const pilotType & p, float x, float y, float vx, float vy, float speed) {
+    if (speed < 0.5f) {
+        return PILOT_INF;
+    }
+    float t = 0.f, dx = vx / speed, dy = vy / speed;
+    for (int i=0; i<16 && t < 256.f; i++) {
+        float w = pilotAt(p.fieldWall, x + dx * t, y + dy * t);
+        if (w < 2.f) {
+            break;
+        }
+        t += w;
+    }
+    return t + 2.f;
+}
+
+// fuel it'd take at least to fly straight to x, y and set down: a sideways burn from now on
+// has until the ship's fallen to y to carry it there against the drag, and the fall then has
+// to be braked to landing speed
+static float pilotFuelNeed(const pilotNodeType & n, float x, float y) {
+    const float drag = 0.25f, term = GRAVITY / drag;
+    float dx = x - n.x, dy = y - n.y;
+    float t = PILOT_INF;
+    if (dy > 0.f) {
+        t = dy / term;
+        for (int i=0; i<6; i++) {
+            float e = exp(-drag * t);
+            t = MAX(t - (term * t + (n.vy - term) / drag * (1.f - e) - dy) / (term + (n.vy - term) * e), 0.01f);
+        }
+    }
+    // px a burn of b s gets on top of coasting, concave in b so newton from 0 creeps up on it
+    float coast = n.vx / drag * (t < PILOT_INF ? 1.f - exp(-drag * t) : 1.f),
+          left = MAX(0.f, fabs(dx - coast) - 6.f), bx = 0.f;
+    for (int i=0; i<8 && left > 0.f; i++) {
+        float late = t < PILOT_INF ? exp(-drag * (t - bx)) : 0.f,
+              got = PLAYER_THRUST / drag * (bx - (late - (t < PILOT_INF ? exp(-drag * t) : 0.f)) / drag),
+              slope = PLAYER_THRUST / drag * (1.f - late);
+        if (slope < 1e-3f) {
+            bx = t + (left - got) / (PLAYER_THRUST / drag);
+            break;
+        }
+        bx += (left - got) / slope;
+        if (t < PILOT_INF && bx > t) {
+            bx = t + (left - PLAYER_THRUST / drag * (t - (1.f - exp(-drag * t)) / drag)) / (PLAYER_THRUST / drag);
+            break;
+        }
+    }
+    float by;
+    if (dy >= 0.f) {
+        float down = MAX(n.vy, 0.f);
+        by = MAX(0.f, MIN(sqrt(down * down + 2.f * GRAVITY * dy), MAX(n.vy, term)) - 9.f) / (PLAYER_THRUST - GRAVITY);
+    }
+    else {
+        by = (-drag * dy + MAX(n.vy, 0.f)) / (PLAYER_THRUST - GRAVITY);
+    }
+    return (bx + by) / FUEL_TANK_CAPACITY;
+}
+
+static float pilotScore(const pilotType & p, const pilotNodeType & n) {
+    if (n.dead) {
+        return PILOT_INF;
+    }
+    if (n.beat) {
+        return 0.f;
+    }
+    const pilotStopType & stop = p.stops[p.route[n.stage]];
+    const bool lands = stop.pickup < 0; // bombs are collected flying through
+    float go = pilotToGo(p, n, stop);
+    if (go >= PILOT_INF) {
+        return PILOT_INF;
+    }
+    float d = go + p.rest[n.stage] + PILOT_STOP_PX * (float)(p.nRoute - 1 - n.stage);
+    float leg = go + p.glide[n.stage]; // px to the next place the ship has to set down
+    float speed = sqrt(n.vx * n.vx + n.vy * n.vy);
+    {
+        const float look = p.tune.look;
+        pilotNodeType a = n;
+        a.x += n.vx * look;
+        a.y += n.vy * look + 0.5f * GRAVITY * look * look;
+        float da = pilotToGo(p, a, stop) + p.rest[n.stage] + PILOT_STOP_PX * (float)(p.nRoute - 1 - n.stage);
+        if (da < d && pilotRoom(p, n.x, n.y, n.vx, n.vy, speed) > pilotDist(n.x, n.y, a.x, a.y)) {
+            d = da;
+        }
+    }
+    // faster than can be shed before reaching a wall or the next stop only looks like progress
+    float room = MIN(leg, pilotRoom(p, n.x, n.y, n.vx, n.vy, speed)),
+          safe = 7.f + sqrt(2.f * 4.f * room);
+    float s = d + 15.f * MAX(0.f, speed - safe);
+    // short of fuel for the way to the next fill up. In the clear it's known how much the leg
+    // takes, a burn in the wrong direction or too late shows up straight away
+    float need;
+    if (lands && pilotAt(stop.fieldFree, n.x, n.y) < pilotDist(n.x, n.y, stop.x, stop.y) * 1.1f + 16.f) {
+        need = pilotFuelNeed(n, stop.x, stop.y) + (stop.depot >= 0 ? 0.05f : 0.15f);
+    }
+    else {
+        need = (go + p.dry[n.stage]) / p.tune.pxPerTank + 0.05f;
+    }
+    s += MAX(0.f, need - n.fuel) * 2000.f;
+#ifdef PILOT_TRACE
+    if (getenv("PCOMP") && n.parent == -7) fprintf(stderr, "  go %.1f d %.1f rest %.1f speed %.1f safe %.1f need %.2f fuel %.2f s %.1f\n", go, d, p.rest[n.stage], speed, safe, need, n.fuel, s);
+#endif
+    // filling up is what a depot stop's for, the ones already made each count a full tank and
+    // the one it's at counts what's in the tank so far
+    for (int k=0; k<=n.stage; k++) {
+        if (p.stops[p.route[k]].depot >= 0) {
+            s -= (k < n.stage ? 1.f : go <= 1.f ? n.fuel : 0.f) * 300.f;
+        }
+    }
+    // a bomb let go of only counts if it's going to open up the way on, and then for more than
+    // one kept so the throw's worth making. The ship has to be clear of it by the time it goes off
+    int gx, gy;
+    bool gate = pilotGate(stop, n, gx, gy);
+    s -= PILOT_BOMB_PX * (float)(n.playerBombs + (gate && pilotCarved(p, n, gx, gy) ? 1 : 0));
+    for (int i=0; i<PILOT_MAX_BOMBS; i++) {
+        s -= gate && pilotOpens(p, n.bombs[i], gx, gy) ? PILOT_BOMB_PX * 2.f : 0.f;
+        if (n.bombs[i].exists && n.bombs[i].hitY < PILOT_INF) {
+            s += MAX(0.f, 12.f - pilotDist(n.x, n.y, n.bombs[i].hitX, n.bombs[i].hitY)) * 10.f;
+        }
+    }
+    // a soaked ship starts burning fuel and dies once it's out
+    s += MAX(0.f, n.water - 0.4f) * 200.f;
+    if (lands && leg < 24.f && n.angle >= 1.f) {
+        // only the upright sprite can set down, anything from 1 up still has to turn back
+        s += (MIN(n.angle, 9.f - n.angle)) * 4.f;
+    }
+    return s;
+}
+
+// px from x, y to stop s, through rock only where open space doesn't get there
+static float pilotLeg(const pilotStopType & s, float x, float y) {
+    float free = pilotAt(s.fieldFree, x, y);
+    return free < PILOT_INF ? free : pilotAt(s.fieldRock, x, y);
+}
+
+static void pilotRest(pilotType & p) {
+    const int last = p.nRoute - 1;
+    p.rest[last] = p.glide[last] = p.dry[last] = 0.f;
+    for (int k=last-1; k>=0; k--) {
+        const pilotStopType & a = p.stops[p.route[k]], & b = p.stops[p.route[k+1]];
+        float leg = pilotLeg(b, a.x, a.y);
+        p.rest[k] = p.rest[k+1] + leg;
+        p.glide[k] = a.pickup >= 0 ? leg + p.glide[k+1] : 0.f;
+        p.dry[k] = a.depot >= 0 ? 0.f : leg + p.dry[k+1];
+    }
+}
+
+struct pilotRouteType {
+    int stops[PILOT_MAX_ROUTE], n;
+    float px, dry; // px flown, tanks it comes up short by on the way
+};
+
+// fewest tanks short to a tenth, then fewest px
+static bool pilotRouteBetter(const pilotRouteType & a, const pilotRouteType & b) {
+    int da = (int)ceil(a.dry * 10.f - 1e-3f), db = (int)ceil(b.dry * 10.f - 1e-3f);
+    return da != db ? da < db : a.px < b.px;
+}
+
+// tries every order of depots & pickups to go by before the flag from x, y, keeping the best
+// few routes in best. A leg through rock uses up a bomb, a full tank lasts pxPerTank px and
+// each depot fills it back up.
+static void pilotRoutes(const pilotType & p, const pilotNodeType & n, const pilotRouteType & r, float x, float y, float fuel, int bombs, uint32_t been,
+                        vector<pilotRouteType> & best, int keep) {
+    for (int i=0; i<PILOT_STOPS; i++) {
+        const pilotStopType & s = p.stops[i];
+        if (s.fieldFree.empty() || ((been >> i) & 1) || (i != 0 && r.n == PILOT_MAX_ROUTE - 1)) {
+            continue;
+        }
+        if ((s.depot >= 0 && n.depotFuel[s.depot] <= 0.05f) || (s.pickup >= 0 && !((n.pickups >> s.pickup) & 1))) {
+            continue;
+        }
+        float free = pilotAt(s.fieldFree, x, y), rock = pilotAt(s.fieldRock, x, y);
+        bool blast = rock < free - 1.f;
+        if (rock >= PILOT_INF || (blast && bombs == 0)) {
+            continue;
+        }
+        float leg = blast ? rock : free,
+              left = fuel - leg / p.tune.pxPerTank;
+        // no point setting down with the tank still 3/4 full when it gets there
+        if (s.depot >= 0 && left > 0.75f) {
+            continue;
+        }
+        pilotRouteType next = r;
+        next.stops[next.n++] = i;
+        next.px += leg + (s.depot >= 0 ? 100.f : 0.f); // setting down & filling up take a while
+        next.dry += MAX(0.f, -left);
+        // routes only get longer & drier, so this one's done as soon as it can't make the best few
+        if ((int)best.size() == keep && !pilotRouteBetter(next, best.back())) {
+            continue;
+        }
+        if (i == 0) {
+            best.insert(std::upper_bound(best.begin(), best.end(), next, pilotRouteBetter), next);
+            if ((int)best.size() > keep) {
+                best.pop_back();
+            }
+        }
+        else {
+            pilotRoutes(p, n, next, s.x, s.y, s.depot >= 0 ? MIN(1.f, MAX(left, 0.f) + n.depotFuel[s.depot]) : MAX(left, 0.f),
+                        bombs - (blast ? 1 : 0) + (s.pickup >= 0 ? 1 : 0), been | (1u << i), best, keep);
+        }
+    }
+}
+
+// sets p's route from n to the rank-th best pilotRoutes finds, false if there aren't that many.
+// p needs every stop's fields, see pilotInit
+bool pilotRoute(pilotType & p, const pilotNodeType & n, int rank) {
+    vector<pilotRouteType> best;
+    pilotRouteType r;
+    r.n = 0;
+    r.px = r.dry = 0.f;
+    pilotRoutes(p, n, r, n.x, n.y, n.fuel, n.playerBombs, 0u, best, rank + 1);
+    if ((int)best.size() <= rank) {
+        return false;
+    }
+    p.nRoute = best[rank].n;
+    for (int i=0; i<p.nRoute; i++) {
+        p.route[i] = best[rank].stops[i];
+    }
+    pilotRest(p);
+    return true;
+}
+
+static uint64_t pilotKey(const pilotNodeType & n) {
+    uint64_t h = 14695981039346656037ull;
+    int v[] = {
+        (int)floorf(n.x), (int)floorf(n.y),
+        (int)floorf(n.vx * 0.5f), (int)floorf(n.vy * 0.5f),
+        (int)floorf(n.angle * 2.f),
+        n.playerBombs, n.nCarve, n.pickups, (int)(n.fuel * 20.f), n.stage
+    };
+    for (int i=0; i<(int)(sizeof(v)/sizeof(v[0])); i++) {
+        h = (h ^ (uint64_t)(uint32_t)v[i]) * 1099511628211ull;
+    }
+    for (int i=0; i<n.nCarve; i++) {
+        h = (h ^ (uint64_t)(n.carves[i].x + (n.carves[i].y << 10))) * 1099511628211ull;
+    }
+    return h;
+}
+
+// appends the inputs that reached beam entry i at step s
+static void pilotTrail(const vector<vector<pilotTrailType>> & trail, int s, int i, vector<uint8_t> & plan) {
+    vector<uint8_t> tail;
+    for (; s>=0; i=trail[s--][i].parent) {
+        const pilotTrailType & t = trail[s][i];
+        for (int k=t.ticks-1; k>=0; k--) {
+            tail.push_back(k == 0 ? t.act : (uint8_t)(t.act & ~LUNAR_ACT_BOMB));
+        }
+    }
+    plan.insert(plan.end(), tail.rbegin(), tail.rend());
+}
+
+// beam search over inputs held for PILOT_TICKS. Each step keeps the best scoring
+// children, at most one per rounded state and a few per 8 px cell so the beam doesn't all
+// pile into one doomed corridor. Appends the found inputs to plan and returns true once the
+// flag's raised; short of that it appends the way to the furthest route stop made, if any.
+bool pilotSearch(pilotType & p, const pilotNodeType & root, int beam, int maxSteps, vector<uint8_t> & plan) {
+    static const uint8_t ACTS[] = {
+        0, LUNAR_ACT_THRUST,
+        LUNAR_ACT_LEFT, LUNAR_ACT_THRUST | LUNAR_ACT_LEFT,
+        LUNAR_ACT_RIGHT, LUNAR_ACT_THRUST | LUNAR_ACT_RIGHT,
+        LUNAR_ACT_BOMB
+    };
+    const double dt = 1. / 60.;
+    const int perCell = MAX(beam / 8, 4);
+    vector<pilotNodeType> cur(1, root), next;
+    vector<vector<pilotTrailType>> trail; // how each beam entry was reached, per step
+    std::unordered_set<uint64_t> seen;
+    std::unordered_map<int, int> cells;
+    vector<float> crowd(64 * 64 * PILOT_MAX_ROUTE, 0.f); // per 8 px cell and route stop
+    vector<int> order;
+    for (int step=0; step<maxSteps; step++) {
+        next.clear();
+        for (int i=0; i<(int)cur.size(); i++) {
+            for (int a=0; a<(int)sizeof(ACTS); a++) {
+                if ((ACTS[a] & LUNAR_ACT_BOMB) && cur[i].playerBombs <= 0) {
+                    continue;
+                }
+                next.push_back(cur[i]);
+                pilotNodeType & n = next.back();
+                n.parent = i;
+                n.act = ACTS[a];
+                n.ticks = 0;
+                while (n.ticks < PILOT_TICKS && !n.dead && !n.beat) {
+                    pilotStep(p, n, n.ticks == 0 ? n.act : (uint8_t)(n.act & ~LUNAR_ACT_BOMB), dt);
+                    n.ticks += 1;
+                }
+                p.ticksRun += n.ticks;
+                n.score = pilotScore(p, n);
+                if (n.score >= PILOT_INF) {
+                    next.pop_back();
+                }
+                else {
+                    n.score += p.fuelWeight * n.fuelUsed + crowd[(CLAMP((int)n.x, 0, 511) >> 3) + ((CLAMP((int)n.y, 0, 511) >> 3) << 6) + (n.stage << 12)];
+                }
+            }
+        }
+        if (next.empty()) {
+#ifdef PILOT_TRACE
+            if (getenv("PDIV")) fprintf(stderr, "all dead at step %d root %.2f,%.2f v %.2f,%.2f a %.2f fuel %.3f water %.2f flag %.2f beat %d\n", step, root.x, root.y, root.vx, root.vy, root.angle, root.fuel, root.water, root.flagH, root.beat);
+#endif
+            break;
+        }
+        order.resize(next.size());
+        for (int i=0; i<(int)next.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return next[a].score < next[b].score; });
+        cur.clear();
+        seen.clear();
+        cells.clear();
+        trail.push_back(vector<pilotTrailType>());
+        for (int i=0; i<(int)order.size() && (int)cur.size() < beam; i++) {
+            const pilotNodeType & n = next[order[i]];
+            // which way it's headed counts too, else sitting still fills the cell before anything's got going
+            int heading = (n.vx < -3.f ? 0 : n.vx > 3.f ? 2 : 1) + (n.vy < -3.f ? 0 : n.vy > 3.f ? 6 : 3);
+            int cell = (CLAMP((int)n.x, 0, 511) >> 3) + ((CLAMP((int)n.y, 0, 511) >> 3) << 6) + (n.nCarve << 12) + (n.playerBombs << 17) + (n.stage << 21) + (heading << 24);
+            if (!n.beat && cells[cell] >= perCell) {
+                continue;
+            }
+            if (seen.insert(pilotKey(n)).second) {
+                cells[cell] += 1;
+                crowd[(cell & 4095) + (n.stage << 12)] += 4.f / (float)perCell;
+                cur.push_back(n);
+                pilotTrailType t = { n.parent, n.act, (uint8_t)n.ticks, n.stage };
+                trail.back().push_back(t);
+            }
+        }
+#ifdef PILOT_TRACE
+        if (getenv("PCOMP")) { pilotNodeType t = cur[0]; t.parent = -7; fprintf(stderr, "%.1f", pilotScore(p, t)); }
+        if (step % 10 == 0 || getenv("PALL")) fprintf(stderr, "st %d step %d n %d best %.1f,%.1f v %.1f,%.1f a %.1f fuel %.2f bombs %d carve %d score %.1f act %d par %d\n", cur[0].stage, step, (int)cur.size(), cur[0].x, cur[0].y, cur[0].vx, cur[0].vy, cur[0].angle, cur[0].fuel, cur[0].playerBombs, cur[0].nCarve, cur[0].score, cur[0].act, cur[0].parent);
+        if (getenv("PNODES") && step == atoi(getenv("PNODES"))) { for (int k=0; k<(int)cur.size(); k++) fprintf(stderr, "  node %d st %d %.1f,%.1f v %.1f,%.1f a %.1f fuel %.2f used %.2f bombs %d score %.1f\n", k, cur[k].stage, cur[k].x, cur[k].y, cur[k].vx, cur[k].vy, cur[k].angle, cur[k].fuel, cur[k].fuelUsed, cur[k].playerBombs, cur[k].score); }
+        if (getenv("PCARVE") && step % 10 == 0) { int gx, gy; bool g = pilotGate(p.stops[p.route[cur[0].stage]], cur[0], gx, gy); fprintf(stderr, "   gate %d %d,%d free %.0f rock %.0f\n", g, gx, gy, pilotAt(p.stops[p.route[cur[0].stage]].fieldFree, cur[0].x, cur[0].y), pilotAt(p.stops[p.route[cur[0].stage]].fieldRock, cur[0].x, cur[0].y)); }
+        if (getenv("PCARVE") && step % 10 == 0) for (int c=0; c<cur[0].nCarve; c++) fprintf(stderr, "   carve %d,%d huge %d\n", cur[0].carves[c].x, cur[0].carves[c].y, cur[0].carves[c].huge);
+#endif
+        if (cur[0].beat) {
+            pilotTrail(trail, (int)trail.size()-1, 0, plan);
+            return true;
+        }
+    }
+    // the best of the furthest along that are still flying, cut back to when they made their stop
+    int s = (int)trail.size() - 1, i = -1;
+    for (int k=0; s>=0 && k<(int)cur.size(); k++) {
+        if (cur[k].stage > root.stage && (i < 0 || cur[k].stage > cur[i].stage)) {
+            i = k;
+        }
+    }
+    if (i >= 0) {
+        const uint8_t stage = cur[i].stage;
+        while (s > 0 && trail[s-1][trail[s][i].parent].stage == stage) {
+            i = trail[s--][i].parent;
+        }
+        pilotTrail(trail, s, i, plan);
+    }
+    return false;
+}
+
+// a route stop as 0 for the flag, 1 + 2 * id for a depot and 2 + 2 * id for a pickup, which
+// stays the same when entRemove shuffles them
+static int pilotStopId(const gameType & g, int stop) {
+    if (stop == 0) {
+        return 0;
+    }
+    return stop < 1 + PILOT_MAX_DEPOT ? 1 + 2 * g.depots[stop - 1].id : 2 + 2 * g.bombPickups[stop - 1 - PILOT_MAX_DEPOT].id;
+}
+
+// -1 once it's blown up or collected
+static int pilotStopOf(const gameType & g, int id) {
+    if (id == 0) {
+        return 0;
+    }
+    for (int i=0; (id & 1) && i<(int)g.depots.size(); i++) {
+        if (1 + 2 * g.depots[i].id == id) {
+            return 1 + i;
+        }
+    }
+    for (int i=0; !(id & 1) && i<(int)g.bombPickups.size(); i++) {
+        if (2 + 2 * g.bombPickups[i].id == id && g.bombPickups[i].available) {
+            return 1 + PILOT_MAX_DEPOT + i;
+        }
+    }
+    return -1;
+}
+
+// plans from g's current state along the rank-th best route and plays the plan through g,
+// replanning whenever the real simulation leaves the planned track. g is left wherever the
+// attempt ended.
+bool pilotSolve(gameType & g, int maxNodes, const pilotTuneType & tune, float fuelWeight, int rank, pilotResultType & r) {
+    static thread_local uint8_t scratch[LUNAR_FRAME_BYTES];
+    uint8_t * oldBfr = bfr64;
+    bfr64 = scratch;
+    const double dt = 1. / 60.;
+    pilotType * p = new pilotType();
+    r.solved = false;
+    r.inputs.clear();
+    r.fuelUsed = 0.f;
+    r.replans = 0;
+    r.ticksRun = 0;
+    g.restarting = false;
+    // water keeps pouring, so where there's a spout the plan is only trusted for a while
+    bool wet = !g.spouts.empty();
+    gameType * ahead = NULL;
+    if (wet) {
+        ahead = new gameType();
+        ahead->alloc();
+    }
+    vector<int> todo, route, ids; // route stops still to make, as pilotStopIds
+    while (!r.solved && !g.playerDead && r.replans < 200) {
+        route.clear();
+        for (int i=0; i<(int)todo.size(); i++) {
+            if (pilotStopOf(g, todo[i]) >= 0) {
+                route.push_back(pilotStopOf(g, todo[i]));
+            }
+        }
+        if (!pilotInit(*p, g, ahead, tune, fuelWeight, route)) {
+            break;
+        }
+        pilotNodeType n;
+        pilotRoot(*p, n, g);
+#ifdef PILOT_TRACE
+        if (getenv("PDROP")) { for (int x0=atoi(getenv("PDROP")); x0<=atoi(getenv("PDROP"))+30; x0+=2) { pilotNodeType m = n; m.x = x0; m.y = atoi(getenv("PDROPY")); m.vx = m.vy = 0; m.angle = 0; int t=0; for (; t<240 && !m.dead; t++) { pilotStep(*p, m, 0, dt); if (getenv("PDROPV") && x0 == atoi(getenv("PDROPV"))) fprintf(stderr, "  t %d %.2f,%.2f v %.2f,%.2f a %.2f dead %d water %.2f fuel %.2f\n", t, m.x, m.y, m.vx, m.vy, m.angle, m.dead, m.water, m.fuel); } if (x0 == atoi(getenv("PDROP"))) for (int yy=0; yy<16; yy++) { for (int xx=0; xx<16; xx++) fprintf(stderr, "%c", (p->shipMask[0][yy]>>xx)&1 ? 79 : 46); fprintf(stderr, "\n"); } fprintf(stderr, "drop %d: %.1f,%.1f dead %d pickups %d flag %.2f\n", x0, m.x, m.y, m.dead, m.pickups, m.flagH); } exit(0); }
+#endif
+#ifdef PILOT_TRACE
+        if (getenv("PSTOPS")) { fprintf(stderr, "start %.0f,%.0f fuel %.2f bombs %d\n", n.x, n.y, n.fuel, n.playerBombs); for (int i=0; i<PILOT_STOPS; i++) if (p->stops[i].fieldFree.size()) { fprintf(stderr, "stop %d at %.0f,%.0f free %.0f rock %.0f\n", i, p->stops[i].x, p->stops[i].y, pilotAt(p->stops[i].fieldFree, n.x, n.y), pilotAt(p->stops[i].fieldRock, n.x, n.y)); for (int j=0; j<PILOT_STOPS; j++) if (j!=i && p->stops[j].fieldFree.size()) fprintf(stderr, "   from %d free %.0f rock %.0f\n", j, pilotAt(p->stops[i].fieldFree, p->stops[j].x, p->stops[j].y), pilotAt(p->stops[i].fieldRock, p->stops[j].x, p->stops[j].y)); } }
+#endif
+        if (todo.empty() && !pilotRoute(*p, n, rank)) {
+            break;
+        }
+#ifdef PILOT_TRACE
+        fprintf(stderr, "route rank %d:", rank); for (int i=0; i<p->nRoute; i++) fprintf(stderr, " %d(%.0f,%.0f rest %.0f dry %.0f)", p->route[i], p->stops[p->route[i]].x, p->stops[p->route[i]].y, p->rest[i], p->dry[i]); fprintf(stderr, "\n");
+#endif
+        ids.resize(p->nRoute);
+        for (int i=0; i<p->nRoute; i++) {
+            ids[i] = pilotStopId(g, p->route[i]);
+        }
+        vector<uint8_t> plan;
+        bool found = pilotSearch(*p, n, maxNodes, 90 * 60 / PILOT_TICKS, plan);
+        r.ticksRun += p->ticksRun;
+        // found with nothing left to do is the ship sat at the flag while it goes up
+        if (plan.empty() && !found) {
+            break;
+        }
+        r.replans += 1;
+        // the model runs alongside, the first tick they disagree on is where to plan from next.
+        // A plan that only gets to a stop on the way is planned on from the end of it
+        for (int t=0; !r.solved && !g.playerDead && (!wet || t < PILOT_REPLAN_TICKS) && (found || t < (int)plan.size()); t++) {
+            uint8_t act = t < (int)plan.size() ? plan[t] : 0;
+            inputType in;
+            in.up = (act & LUNAR_ACT_THRUST) != 0;
+            in.left = (act & LUNAR_ACT_LEFT) != 0;
+            in.right = (act & LUNAR_ACT_RIGHT) != 0;
+            in.bomb = (act & LUNAR_ACT_BOMB) != 0;
+            float fuel = g.playerFuel;
+            pilotStep(*p, n, act, dt);
+            clearBfr();
+            g.update(dt, in);
+            r.inputs.push_back(act);
+            r.fuelUsed += MAX(0.f, fuel - g.playerFuel);
+            r.solved = g.flagH > 1.f;
+            if (n.dead || fabs(g.playerX - n.x) > 0.5f || fabs(g.playerY - n.y) > 0.5f || fabs(g.playerVX - n.vx) > 0.5f || fabs(g.playerVY - n.vy) > 0.5f ||
+                fabs(g.playerFuel - n.fuel) > 0.005f) {
+#ifdef PILOT_TRACE
+                if (getenv("PDIV")) fprintf(stderr, "diverge t %d/%d dead %d game %.2f,%.2f v %.2f,%.2f fuel %.3f dead %d flag %.2f model %.2f,%.2f v %.2f,%.2f fuel %.3f flag %.2f\n", t, (int)plan.size(), n.dead, g.playerX, g.playerY, g.playerVX, g.playerVY, g.playerFuel, g.playerDead, g.flagH, n.x, n.y, n.vx, n.vy, n.fuel, n.flagH);
+#endif
+                break;
+            }
+            // water shoving the ship a little doesn't need a new plan, the model goes on from where the game is
+            n.x = g.playerX; n.y = g.playerY;
+            n.vx = g.playerVX; n.vy = g.playerVY;
+            n.fuel = g.playerFuel;
+            n.water = g.waterLogged;
+        }
+        todo.assign(ids.begin() + n.stage, ids.end());
+#ifdef PILOT_TRACE
+        if (getenv("PDIV")) fprintf(stderr, "plan done: game %.2f,%.2f v %.2f,%.2f fuel %.3f dead %d flag %.2f water %.2f | model %.2f,%.2f fuel %.3f water %.2f dead %d\n", g.playerX, g.playerY, g.playerVX, g.playerVY, g.playerFuel, g.playerDead, g.flagH, g.waterLogged, n.x, n.y, n.fuel, n.water, n.dead);
+#endif
+    }
+    r.fuelLeft = g.playerFuel;
+    if (ahead) {
+        ahead->release();
+        delete ahead;
+    }
+    delete p;
+    bfr64 = oldBfr;
+    return r.solved;
+}
+
+// --solve: proves each level can be flown with the fuel it starts with
+int solveLevels(int from, int to, int beam) {
+    if (!lunarEnvInit("sprites/sprite-sheet.png")) {
+        return 1;
+    }
+    int failed = 0;
+    gameType * g = new gameType();
+    g->alloc();
+    g->silent = true;
+    for (int level=from; level<=to; level++) {
+        const char * modes[] = { "fastest", "thriftiest" };
+        const float weights[] = { 0.f, 150.f };
+        pilotResultType best[2];
+        best[0].solved = best[1].solved = false;
+        int replans = 0;
+        long ticksRun = 0;
+        Clock clock;
+        // each weight & setting flies the best route it can, falling back on the next best while it
+        // fails, and either mode can take a flight the other weight found if it beats its own
+        for (int w=0; w<2; w++) {
+            for (int t=0; t<(int)(sizeof(PILOT_TUNES)/sizeof(PILOT_TUNES[0])); t++) {
+                pilotResultType r;
+                r.solved = false;
+                for (int k=0; k<PILOT_ROUTES && !r.solved; k++) {
+#ifdef PILOT_TRACE
+                    if (getenv("PONLY")) { int om, ot, ok; sscanf(getenv("PONLY"), "%d %d %d", &om, &ot, &ok); if (om != w || ot != t || ok != k) continue; }
+#endif
+                    g->initLevel(level);
+                    pilotSolve(*g, beam, PILOT_TUNES[t], weights[w], k, r);
+                    replans += r.replans;
+                    ticksRun += r.ticksRun;
+                }
+                for (int m=0; m<2 && r.solved; m++) {
+                    if (!best[m].solved || (m == 0 ? r.inputs.size() < best[m].inputs.size() : r.fuelUsed < best[m].fuelUsed)) {
+                        best[m] = r;
+                    }
+                }
+            }
+        }
+        double secs = clock.getElapsedTime().asSeconds();
+        for (int m=0; m<2; m++) {
+            cout << "level " << level << " " << modes[m] << ": ";
+            if (best[m].solved) {
+                cout << "flag up after " << (float)best[m].inputs.size() / 60.f << "s, " << (int)(best[m].fuelUsed * 100.f + 0.5f) << "% of a tank burnt, "
+                     << (int)(best[m].fuelLeft * 100.f + 0.5f) << "% left";
+            }
+            else {
+                cout << "NOT SOLVED";
+                failed += 1;
+            }
+            cout << " (" << replans << " plan" << (replans == 1 ? "" : "s") << ", " << secs << "s, "
+                 << (long)(ticksRun / MAX(secs, 1e-6)) << " planner ticks/s)" << endl;
+        }
+    }
+    g->release();
+    delete g;
+    return failed ? 1 : 0;
+}
+/* --- */
+
+/* CAPTURE */
+// --capture copies each finished frame into a ring of CAP_RING frames allocated up front and a
+// writer thread scales them up and writes them out, either as one .y4m stream (4:4:4, full
+// range BT.601, which ffmpeg turns into FFV1 or anything else) or as numbered lossless .pngs.
+// The game thread only does a memcpy; if the writer falls behind the frame is dropped and
+// counted rather than waited for. Headless replays wait instead, so every tick is written and
+// the same inputs always give the same files.
+
+const int CAP_RING = 256; // ~4s of frames at 60 Hz
+
+struct captureType {
+    char path[1024];
+    bool png;
+    int scale, fps;
+    FILE * fh;
+
+    vector<uint8_t> ring;   // CAP_RING frames of LUNAR_FRAME_BYTES
+    uint64_t head, tail;    // frames handed over & written
+    bool quit;
+    std::mutex m;
+    std::condition_variable wake, room;
+    std::thread writer;
+
+    vector<uint8_t> out;    // scaled frame, writer thread only
+    uint64_t dropped;
+    double copySecs, copyMax, writeSecs;
+};
+
+captureType * capture = NULL;
+
+static void captureWrite(captureType & c, const uint8_t * f, uint64_t frame) {
+    const int w = 64 * c.scale, plane = w * w;
+    if (c.png) {
+        c.out.resize(plane * 4);
+        for (int y=0; y<w; y++) {
+            for (int x=0; x<w; x++) {
+                const uint8_t * p = f + ((x / c.scale) + (y / c.scale) * 64) * 4;
+                uint8_t * o = &c.out[(x + y * w) * 4];
+                o[0] = p[0]; o[1] = p[1]; o[2] = p[2]; o[3] = 0xFF;
+            }
+        }
+        char name[1100];
+        const char * ext = strrchr(c.path, '.');
+        int stem = ext ? (int)(ext - c.path) : (int)strlen(c.path);
+        snprintf(name, sizeof(name), "%.*s%05d%s", stem, c.path, (int)frame, ext ? ext : ".png");
+        Image img;
+        img.create(w, w, c.out.data());
+        if (!img.saveToFile(name)) {
+            cerr << "capture: can't write " << name << endl;
+        }
+        return;
+    }
+    if (!c.fh) {
+        return;
+    }
+    if (frame == 0) {
+        fprintf(c.fh, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", w, w, c.fps);
+    }
+    c.out.resize(plane * 3);
+    uint8_t * yp = c.out.data(), * up = yp + plane, * vp = up + plane;
+    for (int y=0; y<w; y++) {
+        for (int x=0; x<w; x++) {
+            const uint8_t * p = f + ((x / c.scale) + (y / c.scale) * 64) * 4;
+            const int r = p[0], g = p[1], b = p[2], i = x + y * w;
+            yp[i] = (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+            up[i] = (uint8_t)MIN((-43 * r - 85 * g + 128 * b + (128 << 8) + 128) >> 8, 255);
+            vp[i] = (uint8_t)MIN((128 * r - 107 * g - 21 * b + (128 << 8) + 128) >> 8, 255);
+        }
+    }
+    fputs("FRAME\n", c.fh);
+    fwrite(c.out.data(), 1, c.out.size(), c.fh);
+}
+
+static void captureWriter(captureType * c) {
+    Clock clock;
+    while (true) {
+        uint64_t at;
+        {
+            std::unique_lock<std::mutex> lk(c->m);
+            c->wake.wait(lk, [&]{ return c->quit || c->tail < c->head; });
+            if (c->tail == c->head) {
+                return;
+            }
+            at = c->tail;
+        }
+        // the slot is ours until tail moves past it
+        double t0 = clock.getElapsedTime().asSeconds();
+        captureWrite(*c, &c->ring[(at % CAP_RING) * LUNAR_FRAME_BYTES], at);
+        c->writeSecs += clock.getElapsedTime().asSeconds() - t0;
+        {
+            std::lock_guard<std::mutex> lk(c->m);
+            c->tail += 1;
+        }
+        c->room.notify_one();
+    }
+}
+
+// path ending in .png writes path00000.png, path00001.png ..., anything else a .y4m stream
+bool captureStart(const char * path, int scale) {
+    captureType * c = new captureType();
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    size_t len = strlen(path);
+    c->png = len > 4 && !strcmp(path + len - 4, ".png");
+    c->scale = CLAMP(scale, 1, 16);
+    c->fps = 60;
+    c->fh = NULL;
+    if (!c->png) {
+        c->fh = fopen(path, "wb");
+        if (!c->fh) {
+            cerr << "can't write " << path << endl;
+            delete c;
+            return false;
+        }
+    }
+    c->ring.resize(CAP_RING * LUNAR_FRAME_BYTES);
+    c->head = c->tail = 0;
+    c->quit = false;
+    c->dropped = 0;
+    c->copySecs = c->copyMax = c->writeSecs = 0.;
+    c->writer = std::thread(captureWriter, c);
+    capture = c;
+    return true;
+}
+
+// hands a finished frame to the writer, wait only off the game thread
+void captureFrame(const uint8_t * frame, bool wait) {
+    captureType * c = capture;
+    if (!c) {
+        return;
+    }
+    std::unique_lock<std::mutex> lk(c->m);
+    if (c->head - c->tail >= (uint64_t)CAP_RING) {
+        if (!wait) {
+            c->dropped += 1;
+            return;
+        }
+        c->room.wait(lk, [&]{ return c->head - c->tail < (uint64_t)CAP_RING; });
+    }
+    const uint64_t at = c->head;
+    lk.unlock();
+    Clock clock;
+    memcpy(&c->ring[(at % CAP_RING) * LUNAR_FRAME_BYTES], frame, LUNAR_FRAME_BYTES);
+    lk.lock();
+    c->head += 1;
+    lk.unlock();
+    c->wake.notify_one();
+    double secs = clock.getElapsedTime().asSeconds();
+    c->copySecs += secs;
+    c->copyMax = MAX(c->copyMax, secs);
+}
+
+// lets the writer finish what it has and reports what capturing cost
+void captureStop() {
+    captureType * c = capture;
+    if (!c) {
+        return;
+    }
+    capture = NULL;
+    {
+        std::lock_guard<std::mutex> lk(c->m);
+        c->quit = true;
+    }
+    c->wake.notify_one();
+    c->writer.join();
+    if (c->fh) {
+        fclose(c->fh);
+    }
+    const double n = (double)MAX(c->tail, (uint64_t)1);
+    cout << "capture: " << c->tail << " frames to " << c->path << ", " << c->dropped << " dropped; "
+         << c->copySecs * 1e6 / n << " us/frame on the game thread (max " << c->copyMax * 1e6 << " us), "
+         << c->writeSecs * 1e3 / n << " ms/frame writing" << endl;
+    delete c;
+}
+/* --- */
+
+/* FRAME HASH */
+// --hash-record replays a level headless from a fixed input stream and writes a hash of the
+// frame and of each part of the simulation state for every tick to a golden file,
+// --hash-check replays the same inputs and stops at the first tick that hashes differently.
+// Changes meant to leave the output alone (blitters, terrain, particles) are checked with it.
+
+enum { HASH_FRAME, HASH_PLAYER, HASH_TERRAIN, HASH_PARTICLES, HASH_OBJECTS, HASH_RNG, N_HASH };
+const char * HASH_NAMES[N_HASH] = { "frame", "player", "terrain", "particles", "objects", "rng" };
+const uint32_t HASH_MAGIC = 0x48464F4C; // "LOFH"
+
+const uint64_t HASH_P1 = 0x9E3779B185EBCA87ull, HASH_P2 = 0xC2B2AE3D27D4EB4Full, HASH_P3 = 0x165667B19E3779F9ull,
+               HASH_P4 = 0x85EBCA77C2B2AE63ull, HASH_P5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t hashRotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t v) {
+    return hashRotl(acc + v * HASH_P2, 31) * HASH_P1;
+}
+
+// xxHash64
+uint64_t hashBytes(const void * data, size_t len, uint64_t seed = 0) {
+    const uint8_t * p = (const uint8_t *)data, * end = p + len;
+    uint64_t h, w;
+    if (len >= 32) {
+        uint64_t v[4] = { seed + HASH_P1 + HASH_P2, seed + HASH_P2, seed, seed - HASH_P1 };
+        for (; p + 32 <= end; p += 32) {
+            for (int i=0; i<4; i++) {
+                memcpy(&w, p + i * 8, 8);
+                v[i] = hashRound(v[i], w);
+            }
+        }
+        h = hashRotl(v[0], 1) + hashRotl(v[1], 7) + hashRotl(v[2], 12) + hashRotl(v[3], 18);
+        for (int i=0; i<4; i++) {
+            h = (h ^ hashRound(0, v[i])) * HASH_P1 + HASH_P4;
+        }
+    }
+    else {
+        h = seed + HASH_P5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&w, p, 8);
+        h = hashRotl(h ^ hashRound(0, w), 27) * HASH_P1 + HASH_P4;
+    }
+    for (; p < end; p++) {
+        h = hashRotl(h ^ (*p * HASH_P5), 11) * HASH_P1;
+    }
+    h = (h ^ (h >> 33)) * HASH_P2;
+    h = (h ^ (h >> 29)) * HASH_P3;
+    return h ^ (h >> 32);
+}
+
+// field by field, struct padding isn't guaranteed to survive copies
+template<class T> static inline uint64_t hashOf(uint64_t h, const T & v) {
+    return hashBytes(&v, sizeof(T), h);
+}
+
+void frameHash(const gameType & g, uint64_t * out) {
+    out[HASH_FRAME] = hashBytes(bfr64, LUNAR_FRAME_BYTES);
+
+    uint64_t h = 0;
+    const float pf[] = { g.playerX, g.playerY, g.playerVX, g.playerVY, g.playerAngle, g.playerFuel, g.waterLogged,
+                         g.flagX, g.flagY, g.flagH, g.flagVis, g.flashT, g.lastEngineT };
+    const bool pb[] = { g.playerDead, g.beatLevel, g.wasLanded, g.wasGearDown, g.restarting };
+    h = hashOf(h, pf);
+    h = hashOf(h, pb);
+    h = hashOf(h, g.playerBombs);
+    out[HASH_PLAYER] = hashOf(h, g.time);
+
+    out[HASH_TERRAIN] = hashBytes(g.tspecBfr, sizeof(uint8_t) << 20, hashBytes(g.terrainBfr, sizeof(uint16_t) << 20));
+
+    h = hashOf(0, g.prtTop);
+    for (int i=0; i<g.prtTop; i++) {
+        const prtType & p = g.plist[i];
+        const float f[] = { p.x, p.y, p.xv, p.yv, p.energy, p.mass, p.life, p.shadef };
+        h = hashOf(h, p.id);
+        h = hashOf(h, p.still);
+        h = hashOf(h, p.lag);
+        h = hashOf(h, p.rock);
+        h = hashOf(h, p.clr);
+        h = hashOf(h, f);
+        h = hashBytes(p.pal, sizeof(uint32_t) * 9, h);
+    }
+    out[HASH_PARTICLES] = hashBytes(g.waterBfr, 512 * 512, h);
+
+    const int np[] = { (int)g.spouts.size(), (int)g.depots.size(), (int)g.bombPickups.size(), (int)g.bombs.size() };
+    h = hashOf(0, np);
+    for (int i=0; i<(int)g.spouts.size(); i++) {
+        const float f[] = { g.spouts[i].x, g.spouts[i].y };
+        h = hashOf(h, f);
+    }
+    for (int i=0; i<(int)g.depots.size(); i++) {
+        const float f[] = { g.depots[i].x, g.depots[i].y, g.depots[i].fuel };
+        h = hashOf(hashOf(h, g.depots[i].id), f);
+    }
+    for (int i=0; i<(int)g.bombPickups.size(); i++) {
+        const float f[] = { g.bombPickups[i].x, g.bombPickups[i].y };
+        h = hashOf(hashOf(hashOf(h, g.bombPickups[i].id), g.bombPickups[i].available), f);
+    }
+    for (int i=0; i<(int)g.bombs.size(); i++) {
+        const float f[] = { g.bombs[i].t, g.bombs[i].x, g.bombs[i].y, g.bombs[i].xv, g.bombs[i].yv };
+        h = hashOf(h, f);
+    }
+    for (int i=0; i<MAX_CHUNKS; i++) {
+        const chunkType & c = g.chunks[i];
+        h = hashOf(h, c.exists);
+        if (c.exists) {
+            const float f[] = { c.y, c.yv };
+            const int n[] = { c.x, c.w, c.h };
+            h = hashBytes(c.rock.data(), sizeof(uint16_t) * c.rock.size(), hashOf(hashOf(h, f), n));
+        }
+    }
+    out[HASH_OBJECTS] = h;
+
+    out[HASH_RNG] = hashOf(hashOf(hashOf(0, g.rngLevel.s), g.rngPrt.s), g.rngFx.s);
+}
+
+// plays inputs (one LUNAR_ACT_* byte per tick) through a new game, hashes[t * N_HASH ...] after tick t.
+// initLevel leaves the clock & effect timers alone, so nothing is reused from an earlier game
+static double hashReplay(int level, const vector<uint8_t> & inputs, vector<uint64_t> & hashes) {
+    static uint8_t scratch[LUNAR_FRAME_BYTES];
+    uint8_t * oldBfr = bfr64;
+    bfr64 = scratch;
+    gameType g;
+    g.alloc();
+    g.silent = true;
+    g.initLevel(level);
+    hashes.resize(inputs.size() * N_HASH);
+    double hashSecs = 0.;
+    Clock clock;
+    for (int t=0; t<(int)inputs.size(); t++) {
+        inputType in;
+        in.up = (inputs[t] & LUNAR_ACT_THRUST) != 0;
+        in.left = (inputs[t] & LUNAR_ACT_LEFT) != 0;
+        in.right = (inputs[t] & LUNAR_ACT_RIGHT) != 0;
+        in.bomb = (inputs[t] & LUNAR_ACT_BOMB) != 0;
+        clearBfr();
+        g.update(1. / 60., in);
+        double t0 = clock.getElapsedTime().asSeconds();
+        frameHash(g, &hashes[t * N_HASH]);
+        captureFrame(bfr64, true);
+        hashSecs += clock.getElapsedTime().asSeconds() - t0;
+    }
+    double secs = clock.getElapsedTime().asSeconds() - hashSecs; // time spent simulating, not hashing or capturing
+    g.release();
+    bfr64 = oldBfr;
+    return secs;
+}
+
+// inputs from a raw file if given, else the autopilot's flight plus a few seconds of the flag going up
+int hashRecord(const char * golden, int level, const char * inputFile) {
+    if (!lunarEnvInit("sprites/sprite-sheet.png")) {
+        return 1;
+    }
+    vector<uint8_t> inputs;
+    if (inputFile) {
+        std::ifstream fin(inputFile, std::ios::binary);
+        inputs.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    }
+    else {
+        gameType * g = new gameType();
+        g->alloc();
+        g->silent = true;
+        g->initLevel(level);
+        pilotResultType r;
+        pilotSolve(*g, 256, PILOT_TUNES[0], 0.f, 0, r);
+        inputs = r.inputs;
+        inputs.resize(inputs.size() + 180, 0);
+        g->release();
+        delete g;
+    }
+    vector<uint64_t> hashes;
+    double secs = hashReplay(level, inputs, hashes);
+
+    FILE * fh = fopen(golden, "wb");
+    if (!fh) {
+        cerr << "can't write " << golden << endl;
+        return 1;
+    }
+    const int32_t head[] = { (int32_t)HASH_MAGIC, level, (int32_t)inputs.size(), N_HASH };
+    fwrite(head, sizeof(head), 1, fh);
+    fwrite(inputs.data(), 1, inputs.size(), fh);
+    fwrite(hashes.data(), sizeof(uint64_t), hashes.size(), fh);
+    fclose(fh);
+    cout << golden << ": level " << level << ", " << inputs.size() << " frames, "
+         << secs * 1000. / MAX((double)inputs.size(), 1.) << " ms/frame" << endl;
+    return 0;
+}
+
+int hashCheck(const char * golden) {
+    FILE * fh = fopen(golden, "rb");
+    if (!fh) {
+        cerr << "can't read " << golden << endl;
+        return 1;
+    }
+    int32_t head[4];
+    bool ok = fread(head, sizeof(head), 1, fh) == 1 && head[0] == (int32_t)HASH_MAGIC && head[3] == N_HASH &&
+              head[1] >= 1 && head[1] <= N_LEVELS && head[2] >= 0;
+    vector<uint8_t> inputs(ok ? head[2] : 0);
+    vector<uint64_t> want(inputs.size() * N_HASH);
+    ok = ok && fread(inputs.data(), 1, inputs.size(), fh) == inputs.size() &&
+         fread(want.data(), sizeof(uint64_t), want.size(), fh) == want.size();
+    fclose(fh);
+    if (!ok) {
+        cerr << golden << " isn't a frame hash file" << endl;
+        return 1;
+    }
+    if (!lunarEnvInit("sprites/sprite-sheet.png")) {
+        return 1;
+    }
+    vector<uint64_t> got;
+    double secs = hashReplay(head[1], inputs, got);
+
+    for (int t=0; t<(int)inputs.size(); t++) {
+        bool same = true;
+        for (int k=0; k<N_HASH; k++) {
+            same = same && got[t * N_HASH + k] == want[t * N_HASH + k];
+        }
+        if (!same) {
+            cout << golden << ": diverged at frame " << t << " of " << inputs.size() << ", changed:";
+            for (int k=0; k<N_HASH; k++) {
+                if (got[t * N_HASH + k] != want[t * N_HASH + k]) {
+                    cout << " " << HASH_NAMES[k];
+                }
+            }
+            cout << endl;
+            return 1;
+        }
+    }
+    cout << golden << ": " << inputs.size() << " frames match, "
+         << secs * 1000. / MAX((double)inputs.size(), 1.) << " ms/frame" << endl;
+    return 0;
+}
+/* --- */
+
+/* SWARM */
+// Hundreds of landers for ghosts, AI swarms and load tests, on the player's physics but with one
+// array per field and the landers still flying packed at the front. A tick is a straight pass
+// over the arrays for thrust, turning, drag & gravity, then one testing ship masks against a
+// bitmap of the rock (the autopilot's layout), where a mask of 8x8 px tiles with any rock in them
+// skips landers out in the open. Landers don't carry bombs, take on fuel or feel the water.
+
+const int SWARM_TILE = 8;
+const int SWARM_TILES = 512 / SWARM_TILE;
+const int SWARM_GRAIN = 256; // landers per job chunk
+enum { SWARM_FLYING, SWARM_CRASHED, SWARM_HOME };
+
+struct swarmType {
+    int n, live;                   // landers, slots below live are still flying
+    vector<float> x, y, vx, vy, angle, fuel;
+    vector<uint8_t> act;           // LUNAR_ACT_* bits for the next tick, per slot
+    vector<uint8_t> state;         // SWARM_* per slot
+    vector<int> id;                // lander in each slot, slots get swapped as landers drop out
+    uint64_t solid[512 * PILOT_STRIDE];
+    uint64_t tiles[SWARM_TILES];   // bit x of row y set if that tile has rock
+    uint16_t shipMask[8][16];
+    double thrustX[8], thrustY[8]; // per heading, as shipIntegrate works them out
+    uint32_t terrainGen;           // of the rock the bitmaps were built from
+};
+
+// rebuilds the bitmaps if the rock changed since
+static void swarmSync(swarmType & s, const gameType & g) {
+    if (s.terrainGen == g.terrainGen) {
+        return;
+    }
+    s.terrainGen = g.terrainGen;
+    memset(s.solid, 0, sizeof(s.solid));
+    memset(s.tiles, 0, sizeof(s.tiles));
+    // chunks of whole tile rows
+    parallelFor(512, 8 * SWARM_TILE, [&](int y1, int y2) {
+        for (int y=y1; y<y2; y++) {
+            const uint16_t * it = g.terrainBfr + (y << 10);
+            for (int x=0; x<512; x++) {
+                if (it[x] > 0) {
+                    s.solid[y * PILOT_STRIDE + ((x + PILOT_PAD) >> 6)] |= 1ull << ((x + PILOT_PAD) & 63);
+                    s.tiles[y / SWARM_TILE] |= 1ull << (x / SWARM_TILE);
+                }
+            }
+        }
+    });
+}
+
+// any tile with rock under a ship at dx, dy, or 2 px below it
+static inline bool swarmNearRock(const swarmType & s, int dx, int dy) {
+    const int tx1 = CLAMP(dx, 0, 511) / SWARM_TILE, tx2 = CLAMP(dx + 15, 0, 511) / SWARM_TILE,
+              ty1 = CLAMP(dy, 0, 511) / SWARM_TILE, ty2 = CLAMP(dy + 17, 0, 511) / SWARM_TILE;
+    uint64_t any = 0;
+    for (int ty=ty1; ty<=ty2; ty++) {
+        any |= s.tiles[ty];
+    }
+    return (any & (~0ull >> (63 - tx2)) & (~0ull << tx1)) != 0;
+}
+
+// pilotCollide without the craters
+static bool swarmHits(const swarmType & s, const uint16_t * mask, int dx, int dy) {
+    if (dx < -PILOT_PAD || dx > 512 + PILOT_PAD - 16) {
+        return false;
+    }
+    const int bit = dx + PILOT_PAD, w = bit >> 6, sh = bit & 63;
+    for (int y=0; y<16; y++) {
+        if (!mask[y] || (y+dy) < 0 || (y+dy) > 511) {
+            continue;
+        }
+        const uint64_t * row = s.solid + (y+dy) * PILOT_STRIDE + w;
+        uint64_t v = row[0] >> sh;
+        if (sh > 48) {
+            v |= row[1] << (64 - sh);
+        }
+        if ((uint32_t)v & mask[y]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// n landers spread over the clear spots around the level's start
+void swarmInit(swarmType & s, const gameType & g, int n, uint64_t seed) {
+    uint32_t rows[32];
+    for (int a=0; a<8; a++) {
+        pilotMask(SHIP_OFF[a], 0, rows);
+        for (int y=0; y<16; y++) {
+            s.shipMask[a][y] = (uint16_t)rows[y];
+        }
+        float t = ((float)a / 8.f) * PI * 2.f - PI * 0.5f;
+        s.thrustX[a] = cos(t);
+        s.thrustY[a] = sin(t);
+    }
+    s.terrainGen = g.terrainGen - 1u;
+    swarmSync(s, g);
+
+    s.n = s.live = n;
+    s.x.resize(n); s.y.resize(n); s.vx.assign(n, 0.f); s.vy.assign(n, 0.f);
+    s.angle.assign(n, 0.f); s.fuel.assign(n, g.playerFuel);
+    s.act.assign(n, 0); s.state.assign(n, SWARM_FLYING); s.id.resize(n);
+    rngType rng;
+    rngSeed(rng, seed);
+    for (int k=0; k<n; k++) {
+        s.id[k] = k;
+        s.x[k] = g.playerX;
+        s.y[k] = g.playerY;
+        for (int tries=0; tries<64; tries++) {
+            float x = g.playerX + (float)((int)(rngInt(rng) & 127) - 64),
+                  y = g.playerY + (float)((int)(rngInt(rng) & 63) - 16);
+            if (!swarmHits(s, s.shipMask[0], (int)round(x) - 8, (int)round(y) - 8)) {
+                s.x[k] = x;
+                s.y[k] = y;
+                break;
+            }
+        }
+    }
+}
+
+// the flying landers, shipIntegrate without branches
+void swarmIntegrate(swarmType & s, double dt) {
+    float * x = s.x.data(), * y = s.y.data(), * vx = s.vx.data(), * vy = s.vy.data(),
+          * angle = s.angle.data(), * fuel = s.fuel.data();
+    const uint8_t * act = s.act.data();
+    parallelFor(s.live, SWARM_GRAIN, [&](int k1, int k2) {
+        for (int k=k1; k<k2; k++) {
+            const int h = (int)angle[k];
+            const float on = (act[k] & LUNAR_ACT_THRUST) && fuel[k] > 0.f ? 1.f : 0.f,
+                        left = (act[k] & LUNAR_ACT_LEFT) ? 1.f : 0.f,
+                        right = (act[k] & LUNAR_ACT_RIGHT) ? 1.f : 0.f;
+            vx[k] += s.thrustX[h] * dt * PLAYER_THRUST * on;
+            vy[k] += s.thrustY[h] * dt * PLAYER_THRUST * on;
+            fuel[k] -= dt / FUEL_TANK_CAPACITY * on;
+            angle[k] -= dt * PLAYER_TURN_SPEED * left;
+            angle[k] += dt * PLAYER_TURN_SPEED * right;
+            angle[k] = fmodf(angle[k] + 8.f * 100.f, 8.f);
+
+            vx[k] -= vx[k] * dt * 0.25f;
+            vy[k] -= vy[k] * dt * 0.25f;
+            vy[k] += dt * GRAVITY;
+            x[k] += vx[k] * dt;
+            y[k] += vy[k] * dt;
+        }
+    });
+}
+
+// swaps slot k, its state already set, with the last flying slot
+static void swarmRetire(swarmType & s, int k) {
+    const int j = --s.live;
+    std::swap(s.x[k], s.x[j]); std::swap(s.y[k], s.y[j]);
+    std::swap(s.vx[k], s.vx[j]); std::swap(s.vy[k], s.vy[j]);
+    std::swap(s.angle[k], s.angle[j]); std::swap(s.fuel[k], s.fuel[j]);
+    std::swap(s.act[k], s.act[j]); std::swap(s.id[k], s.id[j]);
+    std::swap(s.state[k], s.state[j]);
+}
+
+// where lander k stands after this tick's move, its slot is left where it is
+static void swarmSettle(swarmType & s, const gameType & g, int k) {
+    const int dx = (int)round(s.x[k]) - 8, dy = (int)round(s.y[k]) - 8;
+    const bool near = swarmNearRock(s, dx, dy);
+    uint8_t state = SWARM_FLYING;
+    if (near && s.angle[k] < 1.f && !(s.act[k] & LUNAR_ACT_THRUST) && swarmHits(s, s.shipMask[0], dx, dy + 2)) {
+        if (fabs(s.vy[k]) > 9.f || fabs(s.vx[k]) > 13.f) {
+            state = SWARM_CRASHED;
+        }
+        else if (sqrt((s.x[k]-g.flagX)*(s.x[k]-g.flagX)+(s.y[k]-g.flagY)*(s.y[k]-g.flagY)) < 7.f) {
+            state = SWARM_HOME;
+        }
+        s.vx[k] = 0.f;
+        s.vy[k] = 0.f;
+        s.x[k] = round(s.x[k]);
+        s.y[k] = round(s.y[k]);
+    }
+    if (s.x[k] < -5.f || s.y[k] < -5.f || s.x[k] > 516.f || s.y[k] > 516.f) {
+        state = SWARM_CRASHED;
+    }
+    if (near && swarmHits(s, s.shipMask[(int)s.angle[k]], dx, dy)) {
+        state = SWARM_CRASHED;
+    }
+    s.state[k] = state;
+}
+
+// the player's landing & crash rules, a lander that sets down by the flag is home. Each lander
+// is settled on its own, the ones that are down are then swapped out in slot order.
+void swarmCollide(swarmType & s, const gameType & g) {
+    swarmSync(s, g);
+    parallelFor(s.live, SWARM_GRAIN, [&](int k1, int k2) {
+        for (int k=k1; k<k2; k++) {
+            swarmSettle(s, g, k);
+        }
+    });
+    for (int k=0; k<s.live; k++) {
+        if (s.state[k] != SWARM_FLYING) {
+            swarmRetire(s, k--);
+        }
+    }
+}
+
+void swarmDraw(const swarmType & s, int camX, int camY) {
+    for (int k=0; k<s.live; k++) {
+        const bool on = (s.act[k] & LUNAR_ACT_THRUST) && s.fuel[k] > 0.f;
+        drawSpr((on ? SHIP_ON : SHIP_OFF)[(int)s.angle[k]], (int)round(s.x[k]) - camX + 32-8, (int)round(s.y[k]) - camY + 32-8);
+    }
+}
+
+// n landers hovering about at random over a level for secs while the game runs with the player
+// sat on the pad, the state hash at the end is the same from run to run
+int swarmBench(int n, int level, int secs) {
+    if (!lunarEnvInit("sprites/sprite-sheet.png")) {
+        return 1;
+    }
+    static uint8_t scratch[LUNAR_FRAME_BYTES];
+    bfr64 = scratch;
+    gameType * g = new gameType();
+    g->alloc();
+    g->silent = true;
+    g->initLevel(level);
+    swarmType * s = new swarmType();
+    swarmInit(*s, *g, n, 1234);
+    rngType rng;
+    rngSeed(rng, 5678);
+
+    const double dt = 1. / 60.;
+    const int ticks = secs * 60;
+    double intSecs = 0., colSecs = 0., gameSecs = 0.;
+    Clock clock;
+    for (int t=0; t<ticks; t++) {
+        // burn while falling, lean against drift, now and then a random nudge
+        for (int k=0; k<s->live; k++) {
+            uint8_t a = s->vy[k] > 0.f ? LUNAR_ACT_THRUST : 0;
+            const int want = s->vx[k] > 3.f ? 7 : (s->vx[k] < -3.f ? 1 : 0), h = (int)s->angle[k];
+            const uint32_t r = rngInt(rng) & 31;
+            if (r == 0) {
+                a |= LUNAR_ACT_LEFT;
+            }
+            else if (r == 1) {
+                a |= LUNAR_ACT_RIGHT;
+            }
+            else if (h != want) {
+                a |= ((want - h + 8) & 7) < 4 ? LUNAR_ACT_RIGHT : LUNAR_ACT_LEFT;
+            }
+            s->act[k] = a;
+        }
+        // against the rock as the player sees it this tick, before anything blows up
+        double t0 = clock.getElapsedTime().asSeconds();
+        swarmIntegrate(*s, dt);
+        double t1 = clock.getElapsedTime().asSeconds();
+        swarmCollide(*s, *g);
+        double t2 = clock.getElapsedTime().asSeconds();
+        clearBfr();
+        g->update(dt, inputType());
+        swarmDraw(*s, CLAMP((int)round(g->playerX), 32, 512 - 32), CLAMP((int)round(g->playerY), 32, 512 - 32));
+        double t3 = clock.getElapsedTime().asSeconds();
+        intSecs += t1 - t0;
+        colSecs += t2 - t1;
+        gameSecs += t3 - t2;
+    }
+
+    int home = 0, crashed = 0;
+    uint64_t h = 0;
+    for (int k=0; k<n; k++) {
+        home += s->state[k] == SWARM_HOME;
+        crashed += s->state[k] == SWARM_CRASHED;
+        const float f[] = { s->x[k], s->y[k], s->vx[k], s->vy[k], s->angle[k], s->fuel[k] };
+        h = hashOf(hashOf(hashOf(h, s->id[k]), s->state[k]), f);
+    }
+    const double ms = 1000. / MAX(ticks, 1);
+    cout << n << " landers, level " << level << ", " << ticks << " ticks: integrate " << intSecs * ms
+         << " ms/tick, collide " << colSecs * ms << " ms/tick, game " << gameSecs * ms << " ms/tick; "
+         << s->live << " flying, " << home << " home, " << crashed << " crashed, state "
+         << std::hex << h << std::dec << endl;
+    delete s;
+    g->release();
+    delete g;
+    return 0;
+}
+/* --- */
+
+/* TELEMETRY */
+// Always on and cheap: log-linear histograms of frame, sim & present time plus per frame
+// counters. With --telemetry every TM_FLUSH_SECS the interval's summary is appended to a
+// CSV (or JSON lines) file and sent as a JSON line to every client on 127.0.0.1:TM_PORT.
+
+const int TM_SUB = 16;              // sub-buckets per power of two, ~6% resolution
+const int TM_BUCKETS = 24 * TM_SUB; // up to 2^27 us
+const float TM_FLUSH_SECS = 5.f;
+const unsigned short TM_PORT = 47650;
+const int TM_PENDING_MAX = 1 << 16; // bytes a client can fall behind before it's dropped
+
+enum { TM_FRAME, TM_SIM, TM_PRESENT, N_TM_HIST };
+const char * TM_HIST_NAMES[N_TM_HIST] = { "frame", "sim", "present" };
+enum { TM_FIRE, TM_WATER, TM_DEBRIS, TM_ASLEEP, TM_POOLED, TM_CELLS, TM_CHAIN, TM_COLLIDE, TM_TERRAIN, TM_SOUNDS, TM_QUALITY, N_TM_COUNT };
+const char * TM_COUNT_NAMES[N_TM_COUNT] = { "fire", "water", "debris", "asleep", "pooled", "cells", "chain", "collide", "terrain_px", "sounds", "quality" };
+
+struct tmHistType {
+    uint32_t bucket[TM_BUCKETS];
+    uint32_t n, max;
+};
+
+// a client's socket doesn't block, whatever it hasn't taken yet waits in pending so lines go
+// out whole and in order
+struct tmClientType {
+    TcpSocket * sock;
+    vector<char> pending;
+};
+
+struct telemetryType {
+    tmHistType hist[N_TM_HIST];
+    double countSum[N_TM_COUNT];
+    int countMax[N_TM_COUNT];
+    int frames;
+    Clock sinceFlush, sinceStart;
+
+    FILE * fh;
+    bool json;
+    TcpListener listener;
+    vector<tmClientType> clients;
+};
+
+static int tmBucket(uint32_t us) {
+    if (us < (uint32_t)TM_SUB) {
+        return (int)us;
+    }
+    int e = 4; // 2^e <= us
+    while ((us >> (e + 1)) != 0) {
+        e += 1;
+    }
+    return MIN((e - 3) * TM_SUB + (int)((us >> (e - 4)) & (TM_SUB - 1)), TM_BUCKETS - 1);
+}
+
+// largest value that lands in bucket b
+static uint32_t tmBucketTop(int b) {
+    if (b < TM_SUB) {
+        return (uint32_t)b;
+    }
+    int e = b / TM_SUB + 3;
+    return ((uint32_t)(TM_SUB + b % TM_SUB + 1) << (e - 4)) - 1u;
+}
+
+void tmAdd(tmHistType & h, uint32_t us) {
+    h.bucket[tmBucket(us)] += 1;
+    h.n += 1;
+    h.max = MAX(h.max, us);
+}
+
+uint32_t tmPercentile(const tmHistType & h, float p) {
+    uint32_t want = (uint32_t)ceil((double)h.n * p), seen = 0;
+    for (int b=0; b<TM_BUCKETS; b++) {
+        seen += h.bucket[b];
+        if (seen >= want && seen > 0) {
+            return MIN(tmBucketTop(b), h.max);
+        }
+    }
+    return h.max;
+}
+
+void tmReset(telemetryType & tm) {
+    memset(tm.hist, 0, sizeof(tm.hist));
+    memset(tm.countSum, 0, sizeof(tm.countSum));
+    memset(tm.countMax, 0, sizeof(tm.countMax));
+    tm.frames = 0;
+    tm.sinceFlush.restart();
+}
+
+// fileName NULL keeps collecting but never writes or listens
+void tmStart(telemetryType & tm, const char * fileName) {
+    tmReset(tm);
+    tm.fh = NULL;
+    tm.json = false;
+    if (fileName) {
+        size_t len = strlen(fileName);
+        tm.json = len > 5 && !strcmp(fileName + len - 5, ".json");
+        tm.fh = fopen(fileName, "w");
+        if (!tm.fh) {
+            cerr << "can't write " << fileName << endl;
+        }
+        else if (!tm.json) {
+            fprintf(tm.fh, "t,frames");
+            for (int i=0; i<N_TM_HIST; i++) {
+                fprintf(tm.fh, ",%s_p50_us,%s_p95_us,%s_p99_us,%s_max_us", TM_HIST_NAMES[i], TM_HIST_NAMES[i], TM_HIST_NAMES[i], TM_HIST_NAMES[i]);
+            }
+            for (int i=0; i<N_TM_COUNT; i++) {
+                fprintf(tm.fh, ",%s_avg,%s_max", TM_COUNT_NAMES[i], TM_COUNT_NAMES[i]);
+            }
+            fprintf(tm.fh, "\n");
+        }
+        if (tm.listener.listen(TM_PORT, IpAddress::LocalHost) == Socket::Done) {
+            tm.listener.setBlocking(false);
+        }
+        else {
+            cerr << "telemetry: can't listen on port " << TM_PORT << endl;
+        }
+    }
+}
+
+void tmStop(telemetryType & tm) {
+    if (tm.fh) {
+        fclose(tm.fh);
+    }
+    for (int i=0; i<(int)tm.clients.size(); i++) {
+        delete tm.clients[i].sock;
+    }
+    tm.clients.clear();
+    tm.listener.close();
+}
+
+// picks up new clients and queues line (if any) for all of them, then sends each as much of
+// its queue as it will take. Clients that have gone or fall TM_PENDING_MAX behind are dropped.
+static void tmSend(telemetryType & tm, const char * line, int n) {
+    if (line) {
+        TcpSocket * client = new TcpSocket();
+        while (tm.listener.accept(*client) == Socket::Done) {
+            client->setBlocking(false);
+            tmClientType c;
+            c.sock = client;
+            tm.clients.push_back(c);
+            client = new TcpSocket();
+        }
+        delete client;
+    }
+    for (int i=0; i<(int)tm.clients.size(); i++) {
+        tmClientType & c = tm.clients[i];
+        if (line) {
+            c.pending.insert(c.pending.end(), line, line + n);
+        }
+        Socket::Status st = Socket::Done;
+        if (!c.pending.empty()) {
+            size_t sent = 0;
+            st = c.sock->send(c.pending.data(), c.pending.size(), sent);
+            c.pending.erase(c.pending.begin(), c.pending.begin() + MIN(sent, c.pending.size()));
+        }
+        if (st == Socket::Disconnected || st == Socket::Error || (int)c.pending.size() > TM_PENDING_MAX) {
+            delete c.sock;
+            tm.clients.erase(tm.clients.begin() + i--);
+        }
+    }
+}
+
+// particle & spatial hash counts are read off the game as it was left by this frame's update
+void tmFrame(telemetryType & tm, const gameType * g, uint32_t frameUs, uint32_t simUs, uint32_t presentUs) {
+    tmAdd(tm.hist[TM_FRAME], frameUs);
+    tmAdd(tm.hist[TM_SIM], simUs);
+    tmAdd(tm.hist[TM_PRESENT], presentUs);
+
+    int count[N_TM_COUNT] = { 0 };
+    if (g) {
+        for (int i=0; i<g->prtTop; i++) {
+            const prtType & p = g->plist[i];
+            if (p.life > 0.f) {
+                count[p.pal == PAL_BLUE ? TM_WATER : (p.rock ? TM_DEBRIS : TM_FIRE)] += 1;
+                count[TM_ASLEEP] += p.still >= PRT_SLEEP_FRAMES ? 1 : 0;
             }
-            else if (v == 5) { // water spout
-                if (spoutI < MAX_SPOUT) {
-                    spouts[spoutI].exists = true;
-                    spouts[spoutI].x = 4.f + 8.f * (float)x;
-                    spouts[spoutI].y = 4.f + 8.f * (float)y;
-                    spoutI += 1;
+            if (p.cell >= 0 && g->phash[p.cell] == &p) {
+                int chain = 0;
+                for (const prtType * it = &p; it && chain < MAX_PRT; it = it->next) {
+                    chain += 1;
                 }
+                count[TM_CELLS] += 1;
+                count[TM_CHAIN] = MAX(count[TM_CHAIN], chain);
             }
         }
     }
+    count[TM_POOLED] = g ? g->waterCells : 0;
+    count[TM_COLLIDE] = tmCount.collideCalls;
+    count[TM_TERRAIN] = tmCount.terrainWrites;
+    count[TM_SOUNDS] = tmCount.soundsStarted;
+    count[TM_QUALITY] = g ? g->quality.level : 0;
+    memset(&tmCount, 0, sizeof(tmCount));
+    for (int i=0; i<N_TM_COUNT; i++) {
+        tm.countSum[i] += count[i];
+        tm.countMax[i] = MAX(tm.countMax[i], count[i]);
+    }
+    tm.frames += 1;
 
-    for (int i=0; i<(tnz<<5); i++) {
-        int cx = rand()&511,
-            cy = rand()&511;
-        if (grid[(cx>>3)+((cy>>3)<<6)] != 1) {
-            i --;
-            continue;
+    tmSend(tm, NULL, 0); // the rest of lines slow clients didn't take last time
+    if (tm.sinceFlush.getElapsedTime().asSeconds() < TM_FLUSH_SECS) {
+        return;
+    }
+    if (tm.fh || tm.listener.getLocalPort()) {
+        const float t = tm.sinceStart.getElapsedTime().asSeconds(), nf = (float)MAX(tm.frames, 1);
+        char line[2048], csv[2048];
+        int n = snprintf(line, sizeof(line), "{\"t\":%.2f,\"frames\":%d", t, tm.frames),
+            c = snprintf(csv, sizeof(csv), "%.2f,%d", t, tm.frames);
+        for (int i=0; i<N_TM_HIST; i++) {
+            const tmHistType & h = tm.hist[i];
+            uint32_t p50 = tmPercentile(h, 0.5f), p95 = tmPercentile(h, 0.95f), p99 = tmPercentile(h, 0.99f);
+            n += snprintf(line + n, sizeof(line) - n, ",\"%s_us\":{\"p50\":%u,\"p95\":%u,\"p99\":%u,\"max\":%u}", TM_HIST_NAMES[i], p50, p95, p99, h.max);
+            c += snprintf(csv + c, sizeof(csv) - c, ",%u,%u,%u,%u", p50, p95, p99, h.max);
         }
-        uint64_t spr = ROCKS[rand()%N_ROCKS];
-        int w = SPR_W(spr),
-            h = SPR_H(spr);
-        bool any = false;
-        for (int x=cx-(w>>1); x<cx+(w>>1); x++) {
-            for (int y=cy-(h>>1); y<cy+(h>>1); y++) {
-                if (x>=0 && y>=0) {
-                    int lx = x>>3,
-                        ly = y>>3;
-                    if (lx < 64 && ly < 64) {
-                        if (grid[lx+(ly<<6)] != 1) {
-                            any = true;
-                        }
-                    }
-                    else {
-                        any = true;
-                    }
-                }
-                else {
-                    any = true;
-                }
-            }
+        for (int i=0; i<N_TM_COUNT; i++) {
+            n += snprintf(line + n, sizeof(line) - n, ",\"%s\":{\"avg\":%.1f,\"max\":%d}", TM_COUNT_NAMES[i], tm.countSum[i] / nf, tm.countMax[i]);
+            c += snprintf(csv + c, sizeof(csv) - c, ",%.1f,%d", tm.countSum[i] / nf, tm.countMax[i]);
         }
-        if (!any) {
-            terrainAdd(spr, cx, cy, 64 + (rand() & 63));
+        n += snprintf(line + n, sizeof(line) - n, "}\n");
+        c += snprintf(csv + c, sizeof(csv) - c, "\n");
+        if (tm.fh) {
+            fputs(tm.json ? line : csv, tm.fh);
+            fflush(tm.fh);
         }
+        tmSend(tm, line, n);
     }
+    tmReset(tm);
+}
 
-    for (int i=0; i<((1024<<10)>>7); i++) {
-        long j = (long)((rand() << 15l) + rand()) & ((1l << 20l)-1l);
-        tspecBfr[j] = 1;
+// a one off event, written & sent straight away as a JSON line of its own (a # line in a CSV)
+void tmEvent(telemetryType & tm, const char * name, const char * fields) {
+    if (!tm.fh && !tm.listener.getLocalPort()) {
+        return;
+    }
+    char line[1024];
+    int n = snprintf(line, sizeof(line), "{\"t\":%.2f,\"event\":\"%s\",%s}\n", tm.sinceStart.getElapsedTime().asSeconds(), name, fields);
+    n = MIN(n, (int)sizeof(line) - 1);
+    if (tm.fh) {
+        fprintf(tm.fh, "%s%s", tm.json ? "" : "# ", line);
+        fflush(tm.fh);
     }
+    tmSend(tm, line, n);
+}
+/* --- */
 
-    playerX = (float)(LEVEL_START_X[idx] * 8 + 4);
-    playerY = (float)(LEVEL_START_Y[idx] * 8 + 4);
-    playerVX = 0.f;
-    playerVY = 0.f;
-    playerAngle = 0.f;
-    playerDead = false;
-    playerFuel = 1.f;
-    if (curLevel == 6) {
-        playerFuel = 0.6f;
+/* GOVERNOR */
+// Steps the particle budgets (QUALITY_LEVELS) down when the work in a frame, sim & present
+// without the wait for the frame limit, runs past GOV_TARGET of a tick a few frames running,
+// and back up one at a time once it has stayed under GOV_RAISE for a while. Every change goes
+// to the telemetry stream.
+
+const float GOV_TARGET = 0.8f;
+const float GOV_RAISE = 0.5f;
+const int GOV_DOWN_FRAMES = 3;
+const int GOV_UP_FRAMES = 180;
+
+struct governorType {
+    int level;
+    int over, under; // frames running over GOV_TARGET / under GOV_RAISE
+};
+
+void govReset(governorType & gv) {
+    gv.level = 0;
+    gv.over = gv.under = 0;
+}
+
+// called for frames spent in a level, sets g's budgets
+void govFrame(governorType & gv, telemetryType & tm, gameType * g, uint32_t workUs, int simHz) {
+    const float tickUs = 1e6f / (float)simHz;
+    gv.over = (float)workUs > tickUs * GOV_TARGET ? gv.over + 1 : 0;
+    gv.under = (float)workUs < tickUs * GOV_RAISE ? gv.under + 1 : 0;
+    int level = gv.level;
+    if (gv.over >= GOV_DOWN_FRAMES && level < N_QUALITY-1) {
+        level += 1;
     }
-    playerBombs = 0;
-    waterLogged = 0.25f;
-    beatLevel = false;
+    else if (gv.under >= GOV_UP_FRAMES && level > 0) {
+        level -= 1;
+    }
+    if (level != gv.level) {
+        char fields[256];
+        snprintf(fields, sizeof(fields), "\"from\":%d,\"to\":%d,\"work_us\":%u,\"target_us\":%u",
+                 gv.level, level, workUs, (uint32_t)(tickUs * GOV_TARGET));
+        tmEvent(tm, "quality", fields);
+        gv.level = level;
+        gv.over = gv.under = 0;
+    }
+    g->quality = QUALITY_LEVELS[gv.level];
+}
+/* --- */
+
+/* LEVEL PRELOAD */
+// initLevel clears 3 MB of terrain and scatters the rocks & specs, too much for one frame.
+// While a fade plays the next level is built on a thread into a second gameType and the
+// fade's last frame swaps it in.
+
+struct preloadType {
+    gameType * next;
+    int level;          // level next holds or is being built as, 0 for none
+    std::thread worker;
+};
+
+void preloadStart(preloadType & p, int level) {
+    if (p.level == level) {
+        return;
+    }
+    if (p.worker.joinable()) {
+        p.worker.join();
+    }
+    p.level = level;
+    gameType * next = p.next;
+    p.worker = std::thread([next, level]() { next->initLevel(level); });
+}
+
+// cur with level freshly started in it, cur is kept as the next spare
+gameType * preloadTake(preloadType & p, gameType * cur, int level) {
+    if (p.worker.joinable()) {
+        p.worker.join();
+    }
+    gameType * next = p.next;
+    if (p.level != level) {
+        next->initLevel(level);
+    }
+    // what initLevel leaves alone carries on from the old game
+    next->time = cur->time;
+    next->flashT = cur->flashT;
+    next->lastEngineT = cur->lastEngineT;
+    next->wasLanded = cur->wasLanded;
+    next->wasGearDown = cur->wasGearDown;
+    next->restarting = cur->restarting;
+    next->silent = cur->silent;
+    p.next = cur;
+    p.level = 0;
+    return next;
 }
+/* --- */
+
+#ifndef LUNAR_ENV_LIB
+int main(int argc, char ** argv) {
+
+    const char * telemetryFile = NULL;
+    int simHz = 60; // ticks & frames per second, the ship & bombs are swept so 30 doesn't tunnel
+    int jobs = 0;   // threads splitting rock rebuilds & swarm passes, 0 for all of them
+    for (int i=1; i+1<argc; i++) {
+        if (!strcmp(argv[i], "--jobs")) {
+            jobs = MAX(atoi(argv[i+1]), 1);
+        }
+        else if (!strcmp(argv[i], "--capture")) {
+            int scale = i+2 < argc && argv[i+2][0] != '-' ? atoi(argv[i+2]) : 8;
+            if (captureStart(argv[i+1], scale)) {
+                atexit(captureStop);
+            }
+        }
+    }
+    jobsStart(jobs);
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "--jobs") && i+1 < argc) {
+            i++;
+        }
+        else if (!strcmp(argv[i], "--capture") && i+1 < argc) {
+            i += i+2 < argc && argv[i+2][0] != '-' ? 2 : 1;
+        }
+        else if (!strcmp(argv[i], "--env-bench")) {
+            int k = i+1 < argc ? atoi(argv[i+1]) : 64,
+                threads = i+2 < argc ? atoi(argv[i+2]) : 0,
+                level = i+3 < argc ? atoi(argv[i+3]) : 1;
+            return envBench(MAX(k, 1), threads, CLAMP(level, 1, N_LEVELS), 600);
+        }
+        else if (!strcmp(argv[i], "--swarm-bench")) {
+            int n = i+1 < argc ? atoi(argv[i+1]) : 256,
+                level = i+2 < argc ? atoi(argv[i+2]) : 1,
+                secs = i+3 < argc ? atoi(argv[i+3]) : 30;
+            return swarmBench(MAX(n, 1), CLAMP(level, 1, N_LEVELS), MAX(secs, 1));
+        }
+        else if (!strcmp(argv[i], "--hash-record") && i+1 < argc) {
+            int level = i+2 < argc ? atoi(argv[i+2]) : 1;
+            return hashRecord(argv[i+1], CLAMP(level, 1, N_LEVELS), i+3 < argc ? argv[i+3] : NULL);
+        }
+        else if (!strcmp(argv[i], "--hash-check") && i+1 < argc) {
+            return hashCheck(argv[i+1]);
+        }
+        else if (!strcmp(argv[i], "--solve")) {
+            int level = i+1 < argc ? atoi(argv[i+1]) : 0,
+                beam = i+2 < argc ? atoi(argv[i+2]) : 1024;
+            return level >= 1 ? solveLevels(CLAMP(level, 1, N_LEVELS), CLAMP(level, 1, N_LEVELS), MAX(beam, 1)) : solveLevels(1, N_LEVELS, MAX(beam, 1));
+        }
+        else if (!strcmp(argv[i], "--pack-assets")) {
+            return packAssets(i+1 < argc ? argv[i+1] : PACK_FILE);
+        }
+        else if (!strcmp(argv[i], "--telemetry")) {
+            telemetryFile = i+1 < argc && argv[i+1][0] != '-' ? argv[++i] : "telemetry.csv";
+        }
+        else if (!strcmp(argv[i], "--sim-hz") && i+1 < argc) {
+            simHz = CLAMP(atoi(argv[++i]), 30, 60);
+        }
+    }
+
+    Clock startClock;
 
-int main() {
+    // the sprite sheet is mapped from the pack or decoded below, sounds load behind the intro
+    bool packed = loadPack(PACK_FILE);
+    startSfxLoaders();
 
     bool fullscreen = false;
 
     window = new RenderWindow(VideoMode(800, 600), "Lunar Oasis");
     window->setMouseCursorVisible(false);
 
-    window->setFramerateLimit(60);
+    window->setFramerateLimit(simHz);
+    if (capture) {
+        capture->fps = simHz;
+    }
 
     tex64 = new Texture();
     tex64->create(64, 64);
     tex64->setSmooth(false);
 
     bfr64 = new uint8_t[64*64*4];
-    plist = new prtType[MAX_PRT];
-    phash = new prtType*[512*512];
+    game = new gameType();
+    game->alloc();
 
-    clearParticles();
     clearBfr();
 
     tex64->update(bfr64);
 
     spr64 = new Sprite(*tex64);
 
-    loadSound(SFX_BOMB, "sfx/bomb-explode.wav");
-    loadSound(SFX_ENGINE, "sfx/engine.wav");
-    loadSound(SFX_DIE, "sfx/ship-explode.wav");
-    loadSound(SFX_SELECT, "sfx/select.wav");
-    loadSound(SFX_HOVER, "sfx/hover.wav");
-    loadSound(SFX_GET_BOMB, "sfx/get-bomb.wav");
-    loadSound(SFX_FUEL, "sfx/get-fuel.wav");
-    loadSound(SFX_BACK, "sfx/back.wav");
-    loadSound(SFX_USE_BOMB, "sfx/use-bomb.wav");
-    loadSound(SFX_LAND, "sfx/land.wav");
-    loadSound(SFX_FUEL_WARNING, "sfx/fuel-warning.wav");
-    loadSound(SFX_FLAG, "sfx/flag.wav");
-    loadSound(SFX_WATER, "sfx/water-loop.wav");
-    loadSound(SFX_MUSIC_1, "sfx/music.wav");
-
-    Sound musicSfx;
-    musicSfx.setBuffer(sfx[SFX_MUSIC_1]);
-    musicSfx.setLoop(true);
-    musicSfx.setVolume(75.f);
-    musicSfx.play();
-
-    Sound engineSfx;
-    engineSfx.setBuffer(sfx[SFX_ENGINE]);
-    engineSfx.setLoop(true);
-    engineSfx.setVolume(0.f);
-    engineSfx.setPitch(0.65f);
-    engineSfx.play();
-    Sound warningSfx;
-    warningSfx.setBuffer(sfx[SFX_FUEL_WARNING]);
-    warningSfx.setLoop(true);
-    warningSfx.setVolume(0.f);
-    warningSfx.play();
-    Sound waterSfx;
-    waterSfx.setBuffer(sfx[SFX_WATER]);
-    waterSfx.setLoop(true);
-    waterSfx.setVolume(0.f);
-    waterSfx.play();
-    double waterSfxV = 0.f;
-
-    spritesTex = new Texture();
-    if (!spritesTex->loadFromFile("sprites/sprite-sheet.png")) {
-        cerr << "sprite-sheet.png not found" << endl;
-        exit(0);
+    if (!packed && !loadSprites("sprites/sprite-sheet.png")) {
+        cerr << "Error loading: sprites/sprite-sheet.png" << endl;
+        joinSfxLoaders();
+        return 1;
     }
-    Image spritesImg = spritesTex->copyToImage();
-    sprBfr = (const uint32_t*)spritesImg.getPixelsPtr();
 
-    for (int i=0; i<9; i++) {
-        int x1 = SPR_X(PAL_SPR),
-            y1 = SPR_Y(PAL_SPR);
-        PAL_RED[i]   = sprBfr[x1 + i + ((y1+0) << 10)];
-        PAL_GREEN[i] = sprBfr[x1 + i + ((y1+1) << 10)];
-        PAL_PINK[i]  = sprBfr[x1 + i + ((y1+2) << 10)];
-        PAL_BLUE[i]  = sprBfr[x1 + i + ((y1+3) << 10)];
-        PAL_BROWN[i] = sprBfr[x1 + i + ((y1+4) << 10)];
-        PAL_GREY[i]  = sprBfr[x1 + i + ((y1+5) << 10)];
-    }
+    findMusicTracks();
+    playMusic(0);
 
-    terrainBfr = new uint16_t[1024*1024];
-    tspecBfr = new uint8_t[1024*1024];
+    mixer = new mixerType();
+    mixer->play();
+    bool firstFrame = true, soundsReported = false;
+    double waterSfxV = 0.f;
 
-    initLevel(curLevel);
+    game->initLevel(1);
 
-    double time = 0.;
+    preloadType preload;
+    preload.next = new gameType();
+    preload.next->alloc();
+    preload.level = 0;
 
     bool leftDown = false, rightDown = false, upDown = false, downDown = false, bombDown = false, rDown = false, escDown;
     bool leftPressed = false, rightPressed = false, upPressed = false, downPressed = false, bombPressed = false, rPressed = false, escPressed;
 
-    bool wasLanded = false, wasGearDown = false;
-
-    bool restarting = true, starting = true;
+    bool starting = true;
     float restartT = 1.f;
-    float flashT = 0.f;
+    game->restarting = true;
 
     bool introShowing = true;
     bool introHiding = false;
@@ -1325,17 +5954,33 @@ int main() {
         fread(&levelsBeat, sizeof(levelsBeat), 1, fh);
         fclose(fh);
     }
-    curLevel = MAX(1, MIN(levelsBeat, N_LEVELS));
+    levelSel = MAX(1, MIN(levelsBeat, N_LEVELS));
+
+    telemetryType * telemetry = new telemetryType();
+    tmStart(*telemetry, telemetryFile);
+    governorType governor;
+    govReset(governor);
+    Clock frameClock, phaseClock;
+
+    bool idle = false, paused = false, pauseDrawn = false;
 
-    float lastEngineT = 0.f;
-    
     while (window->isOpen()) {
         leftPressed = false; rightPressed = false; upPressed = false; downPressed = false; bombPressed = false; rPressed = false; escPressed = false;
+        bool pausePressed = false, lostFocus = false;
         Event event;
-        while (window->pollEvent(event)) {
+        // nothing on screen moves until there's input, so sleep until there is
+        bool woken = idle && window->waitEvent(event);
+        if (woken) {
+            frameClock.restart();
+        }
+        while (woken || window->pollEvent(event)) {
+            woken = false;
             if (event.type == Event::Closed) {
                 window->close();
             }
+            else if (event.type == Event::LostFocus) {
+                lostFocus = true;
+            }
             else if (event.type == Event::Resized) {
 	            window->setView(View(FloatRect(0.f, 0.f, (float)window->getSize().x, (float)window->getSize().y)));
             }
@@ -1367,7 +6012,7 @@ int main() {
                     fullscreen = !fullscreen;
                     delete window;
                     window = new RenderWindow(fullscreen ? VideoMode::getDesktopMode() : VideoMode(800, 600), "Lunar Oasis", fullscreen ? Style::Fullscreen : Style::Default);
-                    window->setFramerateLimit(60);
+                    window->setFramerateLimit(simHz);
 	                window->setView(View(FloatRect(0.f, 0.f, (float)window->getSize().x, (float)window->getSize().y)));
                 }
                 else if (event.key.code == Keyboard::Key::Left || event.key.code == Keyboard::Key::A) {
@@ -1398,34 +6043,70 @@ int main() {
                     escDown = false;
                     escPressed = true;
                 }
+                else if (event.key.code == Keyboard::Key::P || event.key.code == Keyboard::Key::Pause) {
+                    pausePressed = true;
+                }
             }
         }
 
-        double dt = 1. / 60.;
-        time += dt;
+        double dt = 1. / (double)simHz;
 
-        if (rPressed && !restarting) {
-            restarting = true;
+        // P or switching away pauses a level, P, R or Esc carries on
+        bool inPlay = !introShowing && !winGameShowing && !levelSelShowing && !game->restarting && game->flagH <= 0.5f;
+        if (paused ? (pausePressed || rPressed || escPressed) : (inPlay && (pausePressed || lostFocus))) {
+            paused = !paused;
+            pauseDrawn = false;
+            if (music) {
+                if (paused) {
+                    music->pause();
+                }
+                else {
+                    music->play();
+                }
+            }
+            rPressed = escPressed = false; // the key that paused or carried on does nothing else
+        }
+
+        if (rPressed && !game->restarting) {
+            game->restarting = true;
             restartT = 0.f;
             playSound(SFX_BACK, 1.f, 0.2f);
         }
 
         if (escPressed) {
-            restarting = true;
+            game->restarting = true;
             restartT = 0.f;
             showLevelSelNext = true;
             playSound(SFX_BACK, 1.f, 0.2f);
         }
 
-        clearBfr();
+        phaseClock.restart();
+        bool inLevel = false;
+
+        if (!paused) {
+            clearBfr();
+        }
 
         //
 
-        if (introShowing) {
+        if (paused) {
+
+            mixerLoop(MIX_LOOP_ENGINE, 0.f, 0.65f);
+            mixerLoop(MIX_LOOP_WARNING, 0.f, 1.f);
+            mixerLoop(MIX_LOOP_WATER, 0.f, 1.f);
 
-            engineSfx.setVolume(0.);
-            warningSfx.setVolume(0.);
-            waterSfx.setVolume(0.);
+            // the frame the game stopped on, dimmed once
+            if (!pauseDrawn) {
+                drawBox(0, 0, 64, 64, 0x80000000);
+                pauseDrawn = true;
+            }
+
+        }
+        else if (introShowing) {
+
+            mixerLoop(MIX_LOOP_ENGINE, 0.f, 0.65f);
+            mixerLoop(MIX_LOOP_WARNING, 0.f, 1.f);
+            mixerLoop(MIX_LOOP_WATER, 0.f, 1.f);
 
             introT += dt / 1.75f;
             drawSpr(INTRO_BG[CLAMP((int)(introT * 5.f), 0, 4)], 0, 0);
@@ -1460,9 +6141,9 @@ int main() {
         }
         else if (winGameShowing) {
 
-            engineSfx.setVolume(0.);
-            warningSfx.setVolume(0.);
-            waterSfx.setVolume(0.);
+            mixerLoop(MIX_LOOP_ENGINE, 0.f, 0.65f);
+            mixerLoop(MIX_LOOP_WARNING, 0.f, 1.f);
+            mixerLoop(MIX_LOOP_WATER, 0.f, 1.f);
 
             winGameT += dt / 3.f;
             drawSpr(INTRO_BG[CLAMP((int)(winGameT * 5.f), 0, 4)], 0, 0);
@@ -1491,9 +6172,9 @@ int main() {
         }
         else if (levelSelShowing) {
 
-            engineSfx.setVolume(0.);
-            warningSfx.setVolume(0.);
-            waterSfx.setVolume(0.);
+            mixerLoop(MIX_LOOP_ENGINE, 0.f, 0.65f);
+            mixerLoop(MIX_LOOP_WARNING, 0.f, 1.f);
+            mixerLoop(MIX_LOOP_WATER, 0.f, 1.f);
 
             levelSelT += dt / 1.75f;
             drawSpr(LEVEL_SEL_BG, 0, 0);
@@ -1518,7 +6199,7 @@ int main() {
                             spr = 1;
                         }
                         drawSpr(LEVEL_SEL_ICONS[spr], x1 - 3, y1 - 3);
-                        if (i == curLevel) {
+                        if (i == levelSel) {
                             drawSpr(LEVEL_SEL_ICONS[3], x1 - 3, y1 - 3);
                         }
                     }
@@ -1526,43 +6207,43 @@ int main() {
             }
 
             if (rightPressed) {
-                if ((curLevel-1) % 3 < 2) {
-                    curLevel += 1;
+                if ((levelSel-1) % 3 < 2) {
+                    levelSel += 1;
                     playSound(SFX_HOVER, 1.f, 0.2f);
                 }
             }
             else if (leftPressed) {
-                if ((curLevel-1) % 3 > 0) {
-                    curLevel -= 1;
+                if ((levelSel-1) % 3 > 0) {
+                    levelSel -= 1;
                     playSound(SFX_HOVER, 1.f, 0.2f);
                 }
             }
             else if (upPressed) {
-                if ((curLevel-1)/3 > 0) {
-                    curLevel -= 3;
+                if ((levelSel-1)/3 > 0) {
+                    levelSel -= 3;
                     playSound(SFX_HOVER, 1.f, 0.2f);
                 }
             }
             else if (downPressed) { 
-                if ((curLevel-1)/3 < ((N_LEVELS-1)/3)) {
-                    curLevel += 3;
+                if ((levelSel-1)/3 < ((N_LEVELS-1)/3)) {
+                    levelSel += 3;
                     playSound(SFX_HOVER, 1.f, 0.2f);
                 }
             }
 
-            if (curLevel > (levelsBeat + 1)) {
-                curLevel = levelsBeat + 1;
+            if (levelSel > (levelsBeat + 1)) {
+                levelSel = levelsBeat + 1;
             }
-            if (curLevel > N_LEVELS) {
-                curLevel = N_LEVELS;
+            if (levelSel > N_LEVELS) {
+                levelSel = N_LEVELS;
             }
-            if (curLevel < 0) {
-                curLevel = 0;
+            if (levelSel < 0) {
+                levelSel = 0;
             }
 
             if (rPressed || bombPressed) {
                 levelSelHiding = true;
-                initLevel(curLevel);
+                preloadStart(preload, levelSel);
                 playSound(SFX_SELECT, 1.f, 0.2f);
             }
             if (escPressed) {
@@ -1583,382 +6264,85 @@ int main() {
                         introHideT = 0.f;
                         levelSelBackNext = false;
                     }
-                }
-            }
-
-        }
-        else {
-
-            drawSpr(LEVEL_BG[curLevel-1], 0, 0);
-
-            lastEngineT -= lastEngineT * dt * 8.f;
-
-            if (!playerDead && !restarting) {
-                if (upDown && playerFuel > 0.f) {
-                    lastEngineT = 1.f;
-                    float angle = (floorf(playerAngle) / 8.f) * PI * 2.f - PI * 0.5f;
-                    playerVX += cos(angle) * dt * PLAYER_THRUST;
-                    playerVY += sin(angle) * dt * PLAYER_THRUST;
-                    playerFuel -= dt / FUEL_TANK_CAPACITY;
-                    //flashT += 1.f * dt * powf((float)((rand() & 0xFF)) / 255.f, 4.f);
-                }
-                if (leftDown) {
-                    playerAngle -= dt * PLAYER_TURN_SPEED;
-                }
-                if (rightDown) {
-                    playerAngle += dt * PLAYER_TURN_SPEED;
-                }
-                playerAngle = fmodf(playerAngle + 8.f * 100.f, 8.f);
-
-                playerVX -= playerVX * dt * 0.25f;
-                playerVY -= playerVY * dt * 0.25f;
-                playerVY += dt * GRAVITY;
-                playerX += playerVX * dt;
-                playerY += playerVY * dt;
-            }
-
-            engineSfx.setVolume(lastEngineT * 100.f);
-            warningSfx.setVolume((playerFuel < 0.25f ? playerFuel < 0.1f ? 0.75 : 0.35 : 0.f) * 25.f);
-            warningSfx.setPitch(playerFuel < 0.25f ? playerFuel < 0.1f ? 1.25 : 1. : 1.f);
-            waterSfx.setVolume(100.f * (curLevel >= 4 ? 0.25f : 0.f));
-
-            int camX = (int)round(playerX),
-                camY = (int)round(playerY);
-
-            camX += ((rand() & 0xFF) * (int)(flashT * 200.f) - 100) / (255 * 20);
-            camY += ((rand() & 0xFF) * (int)(flashT * 200.f) - 100) / (255 * 20);
-
-            camX = CLAMP(camX, 32, 512 - 32);
-            camY = CLAMP(camY, 32, 512 - 32);
-
-            for (int i=0; i<MAX_SPOUT; i++) {
-                if (spouts[i].exists) {
-                    drawSpr(SPOUT_SPR, (int)spouts[i].x - camX - 8 + 32, (int)spouts[i].y - camY - 8 + 32);
-                    addWater(spouts[i].x, spouts[i].y, 0., 4.f);
-                }
-            }
-
-            updateRenderParticles(dt, camX, camY);
-
-            terrainRender(camX, camY);
-
-            for (int i=0; i<MAX_DEPOT; i++) {
-                if (depots[i].exists) {
-                    drawSpr(DEPOT_FRAMES[CLAMP((int)(floor(depots[i].fuel * 5.f)), 0, 4)], -2 + (int)depots[i].x - camX + 32, (int)depots[i].y - camY + 32 - 2);
-                }
-            }
-
-            for (int i=0; i<MAX_BOMB_PICKUP; i++) {
-                if (bombPickups[i].exists) {
-                    if (bombPickups[i].available) {
-                        drawSpr(BOMB_PICKUP_FRAMES[(int)(time * 1.5f) & 1], -2 + (int)bombPickups[i].x - camX + 32, (int)bombPickups[i].y - camY + 32 + 1);
-                    }
-                    else {
-                        drawSpr(BOMB_PICKED_UP, -2 + (int)bombPickups[i].x - camX + 32, (int)bombPickups[i].y - camY + 32 + 1);
-                    }
-                }
-            }
-
-            if (flagVis) {
-                drawSpr(FLAG_FRAMES[CLAMP((int)(floor(flagH * 8.f)), 0, 3)], -2 + (int)flagX - camX + 32, (int)flagY - camY + 32 - 3);
-            }
-
-            if (!playerDead) {
-                bool landed = false;
-                bool landingClose = (int)(floor(playerAngle)) == 0 && sprCollideTerrain(SHIP_OFF[0], (int)round(playerX) - 8, (int)round(playerY) - 8 + 3) && !upDown;
-                if (landingClose != wasGearDown) {
-                    playSound(SFX_LAND, 2.0, 0.5);
-                }
-                wasGearDown = landingClose;
-                bool justDied = false;
-                bool bombEx = false;
-                int bombExI = 0;
-
-                for (int i=0; i<MAX_BOMBS; i++) {
-                    if (bombs[i].exists && !beatLevel) {
-                        bombs[i].t += dt;
-                        bombs[i].xv -= bombs[i].xv * dt * 0.25f;
-                        bombs[i].yv -= bombs[i].yv * dt * 0.25f;
-                        bombs[i].yv += dt * GRAVITY;
-                        bombs[i].x += bombs[i].xv * dt;
-                        bombs[i].y += bombs[i].yv * dt;
-                        drawSpr(BOMB_FRAMES[(int)(time * 3.f) & 1], (int)round(bombs[i].x)-1 - camX + 32, (int)round(bombs[i].y)-2 - camY + 32);
-                        if (!bombEx && sprCollideTerrain(BOMB_FRAMES[0], (int)round(bombs[i].x)-1, (int)round(bombs[i].y)-2)) {
-                            explosion(bombs[i].x, bombs[i].y, bombs[i].xv, bombs[i].yv, 256);
-                            playSound(SFX_BOMB);
-                            flashT += 1.f;
-                            terrainAdd(EX_HUGE, (int)bombs[i].x, (int)bombs[i].y, 0, -400);
-                            bombs[i].exists = false;
-                            bombEx = true;
-                            bombExI = i;
-                            if (sqrt((playerX-bombs[i].x)*(playerX-bombs[i].x)+(playerY-bombs[i].y)*(playerY-bombs[i].y)) < 10.f) {
-                                justDied = true;
-                            }
-                        }
-                    }
-                }
-
-                if (bombEx) {
-                    for (int i=0; i<MAX_DEPOT; i++) {
-                        if (depots[i].exists && (sqrt((bombs[bombExI].x-depots[i].x)*(bombs[bombExI].x-depots[i].x)+(bombs[bombExI].y-depots[i].y)*(bombs[bombExI].y-depots[i].y)) < 7.f)) {
-                            depots[i].exists = false;
-                            explosion(depots[i].x, depots[i].y, 0.f, 0.f, 128);
-                            flashT += 0.5f;
-                            terrainAdd(EX_BIG, (int)depots[i].x, (int)depots[i].y, 0, -400);
-                        }
-                    }
-                    for (int i=0; i<MAX_BOMB_PICKUP; i++) {
-                        if (bombPickups[i].exists && (sqrt((bombs[bombExI].x-bombPickups[i].x)*(bombs[bombExI].x-bombPickups[i].x)+(bombs[bombExI].y-bombPickups[i].y)*(bombs[bombExI].y-bombPickups[i].y)) < 10.f)) {
-                            if (bombPickups[i].available) {
-                                explosion(bombPickups[i].x, bombPickups[i].y, 0.f, 0.f, 256);
-                                flashT += 1.f;
-                                terrainAdd(EX_HUGE, (int)bombPickups[i].x, (int)bombPickups[i].y, 0, -400);
-                            }
-                            bombPickups[i].exists = false;
-                        }
-                    }
-                    if (sqrt((bombs[bombExI].x-flagX)*(bombs[bombExI].x-flagX)+(bombs[bombExI].y-flagY)*(bombs[bombExI].y-flagY)) < 7.f) {
-                        justDied = true;
-                        flagVis = false;
-                    }
-                }
-
-                if (bombPressed && playerBombs > 0) {
-                    for (int i=0; i<MAX_BOMBS; i++) {
-                        if (!bombs[i].exists) {
-                            bombs[i].exists = true;
-                            bombs[i].t = 0.f;
-                            bombs[i].xv = playerVX * 1.0f;
-                            bombs[i].yv = playerVY * 2.f;
-                            bombs[i].x = playerX;
-                            bombs[i].y = playerY;
-                            playerBombs -= 1;
-                            playSound(SFX_USE_BOMB);
-                            break;
-                        }
-                    }
-                }
-
-                if (waterLogged > 0.75f && playerFuel <= 0.f) {
-                    justDied = true;
-                }
-
-                if ((int)(floor(playerAngle)) == 0 && sprCollideTerrain(SHIP_OFF[0], (int)round(playerX) - 8, (int)round(playerY) - 8 + 2) && !upDown) {
-                    if (fabs(playerVY) > 9.f || fabs(playerVX) > 13.f) {
-                        justDied = true;
-                        beatLevel = false;
-                    }
-                    else {
-                        landed = true;
-                        if (!wasLanded && landed) {
-                            playSound(SFX_LAND);
-                            for (int i=0; i<MAX_DEPOT; i++) {
-                                if (depots[i].exists && sqrt((playerX-depots[i].x)*(playerX-depots[i].x)+(playerY-depots[i].y)*(playerY-depots[i].y)) < 7.f) {
-                                    playSound(SFX_FUEL, 0.5, 0.5);
-                                    break;
-                                }
-                            }
-                            if (sqrt((playerX-flagX)*(playerX-flagX)+(playerY-flagY)*(playerY-flagY)) < 7.f) {
-                                playSound(SFX_FUEL, 0.75);
-                            }
-                        }
-                        wasLanded = landed;
-                    }
-                    playerVX = 0.f;
-                    playerVY = 0.f;
-                    playerX = round(playerX);
-                    playerY = round(playerY);
-                }
-                else {
-                    wasLanded = false;
-                }
-                if (playerX < -5.f || playerY < -5.f || playerX > 516.f || playerY > 516.f) {
-                    if (!beatLevel) {
-                        justDied = true;
-                    }
-                }
-                if (sprCollideTerrain(SHIP_OFF[(int)(floor(playerAngle))], (int)round(playerX) - 8, (int)round(playerY) - 8)) {
-                    if (!beatLevel) {
-                        justDied = true;
-                    }
-                }
-
-                if (upDown && playerFuel > 0.f && !restarting && flagH < 0.5f) {
-                    drawSpr(SHIP_ON[(int)(floor(playerAngle))], (int)round(playerX) - camX + 32-8, (int)round(playerY) - camY + 32-8);
-                    float angle = (floorf(playerAngle) / 8.f) * PI * 2.f + PI * 0.5f;
-                    addFire(playerX + cos(angle) * 3.5f, playerY + sin(angle) * 3.5f, cos(angle) * 20.f, sin(angle) * 20.f);
-                }
-                else {
-                    if (landed || landingClose) {
-                        drawSpr(SHIP_LANDED, (int)round(playerX) - camX + 32-8, (int)round(playerY) - camY + 32-8);
-                    }
                     else {
-                        drawSpr(SHIP_OFF[(int)(floor(playerAngle))], (int)round(playerX) - camX + 32-8, (int)round(playerY) - camY + 32-8);
-                    }
-                }
-
-                if (justDied && !restarting) {
-                    playSound(SFX_DIE);
-                    explosion(playerX, playerY, playerVX, playerVY, 256);
-                    flashT += 1.f;
-                    terrainAdd(EX_BIG, (int)playerX, (int)playerY, 0, -400);
-                    playerDead = true;
-                    playerBombs = 0;
-                    playerFuel = 0.f;
-                    for (int i=0; i<MAX_DEPOT; i++) {
-                        if (depots[i].exists && (sqrt((playerX-depots[i].x)*(playerX-depots[i].x)+(playerY-depots[i].y)*(playerY-depots[i].y)) < 7.f)) {
-                            depots[i].exists = false;
-                            explosion(depots[i].x, depots[i].y, 0.f, 0.f, 128);
-                            flashT += 0.5f;
-                            terrainAdd(EX_BIG, (int)depots[i].x, (int)depots[i].y, 0, -400);
-                        }
-                    }
-                    for (int i=0; i<MAX_BOMB_PICKUP; i++) {
-                        if (bombPickups[i].exists && (sqrt((playerX-bombPickups[i].x)*(playerX-bombPickups[i].x)+(playerY-bombPickups[i].y)*(playerY-bombPickups[i].y)) < 9.f)) {
-                            if (bombPickups[i].available) {
-                                explosion(bombPickups[i].x, bombPickups[i].y, 0.f, 0.f, 256);
-                                flashT += 0.5f;
-                                terrainAdd(EX_HUGE, (int)bombPickups[i].x, (int)bombPickups[i].y, 0, -400);
-                            }
-                            bombPickups[i].exists = false;
-                        }
-                    }
-                    if (sqrt((playerX-flagX)*(playerX-flagX)+(playerY-flagY)*(playerY-flagY)) < 11.f) {
-                        flagVis = false;
-                    }
-                }
-                else if (landed && sqrt((playerX-flagX)*(playerX-flagX)+(playerY-flagY)*(playerY-flagY)) < 7.f) {
-                    flagH += dt * 0.5f;
-                    beatLevel = true;
-                }
-                else {
-                    flagH -= dt * 0.5f;
-                    if (flagH < 0.f) {
-                        flagH = 0.f;
-                    }
-                }
-
-                if (landed) {
-                    for (int i=0; i<MAX_DEPOT; i++) {
-                        if (depots[i].exists && sqrt((playerX-depots[i].x)*(playerX-depots[i].x)+(playerY-depots[i].y)*(playerY-depots[i].y)) < 7.f) {
-                            float take = MIN(depots[i].fuel, MIN(dt / 3.f, 1.f - playerFuel));
-                            if (take > 0.f) {
-                                depots[i].fuel -= take;
-                                playerFuel += take;
-                                if (playerFuel > 1.f) {
-                                    playerFuel = 1.f;
-                                }
-                            }
-                        }
-                    }
-                }
-
-                for (int i=0; i<MAX_BOMB_PICKUP; i++) {
-                    if (bombPickups[i].exists && ((playerX-bombPickups[i].x)*(playerX-bombPickups[i].x)+(playerY-bombPickups[i].y)*(playerY-bombPickups[i].y)) < 9.f) {
-                        if (bombPickups[i].available) {
-                            playSound(SFX_GET_BOMB);
-                            playerBombs += 1;
-                            bombPickups[i].available = false;
-                        }
+                        game = preloadTake(preload, game, levelSel);
                     }
                 }
             }
 
-            if (flashT > 0.01f) {
-                flashT -= flashT * dt * 2.f;
-                drawBox(0, 0, 64, 64, 0xFFFFFF | (CLAMP((uint32_t)(flashT * 255.f), 0, 255) << 24u));
-            }
-            else {
-                flashT = 0.f;
-                if (playerDead) {
-                    restarting = true;
-                }
-            }
-
-            if (waterLogged > 0.75f && !playerDead) {
-                playerFuel -= waterLogged * 2.0f * dt;
-                if (playerFuel < 0.f) {
-                    playerFuel = 0.f;
-                }
-            }
-
-            drawSpr(FUEL_BAR_BG, 0, 0);
-            drawSpr(SPR_X(FUEL_BAR), SPR_Y(FUEL_BAR), CLAMP(SPR_W(FUEL_BAR) * (int)(255.f * playerFuel) / 255, 0, SPR_W(FUEL_BAR)), SPR_H(FUEL_BAR), 3, 3);
-
-            if (!playerDead) {
-                waterLogged += waterPercentInRadius(playerX, playerY, 3.f) * dt * 2.f;
-                if (waterLogged > 1.f) {
-                    waterLogged = 1.f;
-                }
-            }
-
-            if (waterLogged > 0.f || curLevel >= 4) {
-                drawSpr(WATER_BAR_BG, 0, 55);
-                drawSpr(SPR_X(WATER_BAR), SPR_Y(WATER_BAR), CLAMP(SPR_W(WATER_BAR) * (int)(255.f * waterLogged) / 255, 0, SPR_W(WATER_BAR)), SPR_H(WATER_BAR), 3, 55 + 3);
-                if (!playerDead) {
-                    waterLogged -= dt * 1.f;
-                    if (waterLogged < 0.f) {
-                        waterLogged = 0.f;
-                    }
-                }
-            }
-
-            for (int i=0; i<playerBombs; i++) {
-                drawSpr(BOMB_HUD_FRAMES[(int)(time) & 1], 2 + i * 5, 9);
-            }
+        }
+        else {
 
-            if (flagH > 0.5f) {
-                if (flagH > 1.f) {
+            inLevel = true;
+            inputType in;
+            in.up = upDown;
+            in.left = leftDown;
+            in.right = rightDown;
+            in.bomb = bombPressed;
+            game->update(dt, in);
+
+            mixerLoop(MIX_LOOP_ENGINE, game->lastEngineT, 0.65f);
+            mixerLoop(MIX_LOOP_WARNING, (game->playerFuel < 0.25f ? game->playerFuel < 0.1f ? 0.75f : 0.35f : 0.f) * 0.25f,
+                      game->playerFuel < 0.25f ? game->playerFuel < 0.1f ? 1.25f : 1.f : 1.f);
+            mixerLoop(MIX_LOOP_WATER, game->curLevel >= 4 ? 0.25f : 0.f, 1.f);
+
+            if (game->flagH > 0.5f) {
+                if (game->flagH > 1.f) {
                     drawBox(0, 0, 64, 64, 0xFF000000);
-                    lastEngineT = 0.f;
-                    if (curLevel >= N_LEVELS) {
+                    game->lastEngineT = 0.f;
+                    if (game->curLevel >= N_LEVELS) {
                         winGameShowing = true;
                         winGameHiding = false;
                         winGameT = 0.f;
                         winGimeHideT = 0.f;
                         winGameNext = false;
                     }
-                    initLevel(MIN(curLevel + 1, N_LEVELS));
+                    game = preloadTake(preload, game, MIN(game->curLevel + 1, N_LEVELS));
                     FILE * fh = fopen("save.bin", "wb");
-                    levelsBeat = MAX(levelsBeat, curLevel-1);
+                    levelsBeat = MAX(levelsBeat, game->curLevel-1);
                     if (fh) {
                         fwrite(&levelsBeat, sizeof(levelsBeat), 1, fh);
                         fclose(fh);
                     }
-                    restarting = true;
+                    game->restarting = true;
                     restartT = 1.f;
                     starting = true;
                     playSound(SFX_FLAG);
                 }
                 else {
-                    drawNotCircle(32, 32, (int)(48.f - CLAMP((flagH*2.f - 1.f) * 48.f, 0., 48.f)), 0xFF000000);
+                    preloadStart(preload, MIN(game->curLevel + 1, N_LEVELS));
+                    drawNotCircle(32, 32, (int)(48.f - CLAMP((game->flagH*2.f - 1.f) * 48.f, 0., 48.f)), 0xFF000000);
                 }
             }
 
-            if (restarting) {
+            if (game->restarting) {
                 if (restartT > 1.f && !starting) {
                     restartT = 1.f;
                     drawBox(0, 0, 64, 64, 0xFF000000);
                     starting = true;
                     if (showLevelSelNext) {
                         showLevelSelNext = false;
+                        levelSel = game->curLevel;
                         levelSelShowing = true;
                         levelSelT = 0.f;
                         levelSelHiding = false;
                         levelSideHideT = 0.f;
                     }
                     else {
-                        lastEngineT = 0.f;
-                        initLevel(curLevel);
+                        game->lastEngineT = 0.f;
+                        game = preloadTake(preload, game, game->curLevel);
                     }
                 }
                 else {
+                    if (!starting && !showLevelSelNext) {
+                        preloadStart(preload, game->curLevel);
+                    }
                     drawNotCircle(32, 32, (int)(48.f - CLAMP(restartT * 48.f, 0., 48.f)), 0xFF000000);
                 }
                 if (starting) {
                     restartT -= dt;
                     if (restartT < 0.f) {
-                        restarting = false;
+                        game->restarting = false;
                         starting = false;
                     }
                 }
@@ -1970,6 +6354,20 @@ int main() {
 
         //
 
+        if (!paused) {
+            playMusic(inLevel ? game->curLevel : 0);
+        }
+        mixerFrame();
+
+        // menus are static once their transitions are done
+        idle = paused ||
+               (introShowing && !introHiding && introT > 2.1f) ||
+               (levelSelShowing && !levelSelHiding && levelSelT > 1.f) ||
+               (winGameShowing && !winGameHiding && winGameT > 1.6f);
+
+        uint32_t simUs = (uint32_t)phaseClock.restart().asMicroseconds();
+
+        captureFrame(bfr64, false);
         tex64->update(bfr64);
 
         window->clear(Color::Black);
@@ -1987,19 +6385,45 @@ int main() {
 
         window->draw(*spr64);
 
+        // display() also sleeps for the frame rate limit, so it only counts towards the frame time
+        uint32_t presentUs = (uint32_t)phaseClock.restart().asMicroseconds();
+
         window->display();
+
+        if (firstFrame) {
+            firstFrame = false;
+            cout << "first frame after " << startClock.getElapsedTime().asMilliseconds() << " ms" << endl;
+        }
+        if (!soundsReported && sfxLoadersDone == (int)sfxLoaders.size()) {
+            soundsReported = true;
+            cout << "sounds loaded after " << startClock.getElapsedTime().asMilliseconds() << " ms" << endl;
+        }
+
+        if (inLevel) {
+            govFrame(governor, *telemetry, game, simUs + presentUs, simHz);
+        }
+        tmFrame(*telemetry, inLevel ? game : NULL, (uint32_t)frameClock.restart().asMicroseconds(), simUs, presentUs);
     }
 
-    delete plist;
-    delete phash;
-    delete terrainBfr;
-    delete tspecBfr;
-    delete sprBfr;
-    delete spritesTex;
-    delete bfr64;
+    delete mixer;
+    mixer = NULL;
+    joinSfxLoaders();
+    delete music;
+    tmStop(*telemetry);
+    delete telemetry;
+    if (preload.worker.joinable()) {
+        preload.worker.join();
+    }
+    preload.next->release();
+    delete preload.next;
+    game->release();
+    delete game;
+    delete spritesImg;
+    delete[] bfr64;
     delete tex64;
     delete spr64;
     delete window;
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -6,5 +6,6 @@
 @xcopy sprites build\sprites /i /E
 @xcopy sfx build\sfx /i /E
 @cd build/
+@LunarOasis.exe --pack-assets
 @LunarOasis.exe
 @cd ..
\ No newline at end of file